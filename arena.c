@@ -0,0 +1,83 @@
+/* Storage for the vertices of solutions. Blocks are rounded up to a
+   power of two, so a freed block can be reused by any solution of
+   about the same length, and solutions never have to be moved to make
+   room. Allocation may happen on any thread. */
+
+static int
+arena_class(int count) {
+  int k = 0;
+  while ((ARENA_MIN_BLOCK << k) < count)
+    k++;
+  return k;
+}
+
+void
+arena_init(vertex_arena_t *arena) {
+  arena->num_chunks = 0;
+  arena->top = 0;
+  for (int k = 0; k < ARENA_NUM_CLASSES; k++)
+    arena->free_list[k] = -1;
+  arena->mutex = SDL_CreateMutex();
+}
+
+static float (*arena_vertices(const vertex_arena_t *arena, int first))[2] {
+  return arena->chunks[first / ARENA_CHUNK_SIZE] + first % ARENA_CHUNK_SIZE;
+}
+
+/* The first vertex of a block of at least `count` vertices, or -1 if
+   there is no memory for one. */
+int
+arena_alloc(vertex_arena_t *arena, int count) {
+  int k = arena_class(count);
+  if (k >= ARENA_NUM_CLASSES)
+    return -1;
+  int size = ARENA_MIN_BLOCK << k;
+
+  SDL_LockMutex(arena->mutex);
+  int first = arena->free_list[k];
+  if (first >= 0) {
+    memcpy(&arena->free_list[k], arena_vertices(arena, first), sizeof(int));
+  }
+  else {
+    /* Blocks never straddle two chunks */
+    if (arena->top % ARENA_CHUNK_SIZE + size > ARENA_CHUNK_SIZE)
+      arena->top += ARENA_CHUNK_SIZE - arena->top % ARENA_CHUNK_SIZE;
+
+    int chunk = arena->top / ARENA_CHUNK_SIZE;
+    if (chunk == arena->num_chunks && chunk < ARENA_MAX_CHUNKS) {
+      arena->chunks[chunk] = malloc(sizeof(float[2]) * ARENA_CHUNK_SIZE);
+      if (arena->chunks[chunk])
+        arena->num_chunks++;
+    }
+    if (chunk < arena->num_chunks) {
+      first = arena->top;
+      arena->top += size;
+    }
+  }
+  SDL_UnlockMutex(arena->mutex);
+  return first;
+}
+
+void
+arena_free(vertex_arena_t *arena, int first, int count) {
+  int k = arena_class(count);
+  SDL_LockMutex(arena->mutex);
+  memcpy(arena_vertices(arena, first), &arena->free_list[k], sizeof(int));
+  arena->free_list[k] = first;
+  SDL_UnlockMutex(arena->mutex);
+}
+
+/* Forget every block, keeping the chunks for reuse */
+void
+arena_clear(vertex_arena_t *arena) {
+  arena->top = 0;
+  for (int k = 0; k < ARENA_NUM_CLASSES; k++)
+    arena->free_list[k] = -1;
+}
+
+void
+arena_destroy(vertex_arena_t *arena) {
+  for (int i = 0; i < arena->num_chunks; i++)
+    free(arena->chunks[i]);
+  SDL_DestroyMutex(arena->mutex);
+}
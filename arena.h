@@ -0,0 +1,24 @@
+#pragma once
+
+/* Vertices of solutions come from chunks that are never moved, in
+   blocks of a power of two vertices. A block is named by the index of
+   its first vertex counting across chunks, which is also where it is
+   kept in the GPU buffer. */
+#define ARENA_CHUNK_SIZE (1 << 18)      /* vertices */
+#define ARENA_MAX_CHUNKS 1024
+#define ARENA_MIN_BLOCK 16
+#define ARENA_NUM_CLASSES 8             /* blocks of 16 to 2048 vertices */
+
+typedef struct {
+  float (*chunks[ARENA_MAX_CHUNKS])[2];
+  int num_chunks;
+
+  /* Every vertex before this has been handed out at some point */
+  int top;
+
+  /* Freed blocks of each size, linked through their first vertex; -1
+     when empty */
+  int free_list[ARENA_NUM_CLASSES];
+
+  SDL_mutex *mutex;
+} vertex_arena_t;
@@ -0,0 +1,97 @@
+/* Keeps everything built from the most recently used equations, so
+   switching back to one of them is a lookup instead of a parse,
+   derivation, JIT compile and shader link. Entries are keyed by the equations with
+   insignificant whitespace removed. */
+
+/* Characters that run together into one name or number */
+static bool
+is_word_char(char c) {
+  return is_alpha(c) || is_digit(c) || c == '_' || c == '.';
+}
+
+/* Copy `src` without spaces, except for one where it separates two
+   names or numbers ("a b" must stay an error rather than become the
+   parameter "ab"). The copy is never longer than `src`. Returns false
+   if it does not fit in `size` bytes, rather than cutting it short. */
+static bool
+normalise_equation(char *out, size_t size, const char *src) {
+  size_t length = 0;
+  char last = 0;
+  bool space = false;
+
+  for (; *src; src++) {
+    if (is_white(*src)) {
+      space = true;
+      continue;
+    }
+    bool separate = space && is_word_char(last) && is_word_char(*src);
+    if (length + separate + 1 >= size)
+      return false;
+    if (separate)
+      out[length++] = ' ';
+    out[length++] = last = *src;
+    space = false;
+  }
+  out[length] = 0;
+  return true;
+}
+
+static uint64_t
+compile_cache_key(const char *xeqn, const char *yeqn, const char *stop_eqn) {
+  const char *eqns[3] = { xeqn, yeqn, stop_eqn };
+  uint64_t h = 14695981039346656037u;
+  for (int i = 0; i < 3; i++) {
+    for (const char *c = eqns[i]; *c; c++)
+      h = (h ^ (unsigned char)*c) * 1099511628211u;
+    h = (h ^ 0xff) * 1099511628211u;   /* separator */
+  }
+  return h;
+}
+
+static compiled_entry_t *
+compile_cache_find(compiled_entry_t *cache, uint64_t key, const char *xeqn,
+                   const char *yeqn, const char *stop_eqn) {
+  for (int i = 0; i < COMPILE_CACHE_SIZE; i++) {
+    compiled_entry_t *entry = &cache[i];
+    if (entry->last_used && entry->key == key &&
+        strcmp(entry->xeqn, xeqn) == 0 && strcmp(entry->yeqn, yeqn) == 0 &&
+        strcmp(entry->stop_eqn, stop_eqn) == 0)
+      return entry;
+  }
+  return NULL;
+}
+
+/* Free what `entry` holds outside itself. Its program was built only
+   once there was a GL context, which still exists. */
+static void
+compile_entry_release(compiled_entry_t *entry) {
+  jit_release(&entry->jit);
+  jit_release(&entry->jacobian_jit);
+  if (entry->field_program)
+    glDeleteProgram(entry->field_program);
+  entry->field_program = 0;
+  entry->field_program_built = false;
+}
+
+/* An empty entry, or else the least recently used one, emptied.
+   Entries pinned by a solve job are passed over; there is only ever
+   one job. */
+static compiled_entry_t *
+compile_cache_evict(compiled_entry_t *cache) {
+  compiled_entry_t *victim = NULL;
+  for (int i = 0; i < COMPILE_CACHE_SIZE; i++)
+    if (!cache[i].pinned &&
+        (!victim || cache[i].last_used < victim->last_used))
+      victim = &cache[i];
+
+  compile_entry_release(victim);
+  victim->last_used = 0;
+  return victim;
+}
+
+static void
+compile_cache_release(compiled_entry_t *cache) {
+  for (int i = 0; i < COMPILE_CACHE_SIZE; i++)
+    compile_entry_release(&cache[i]);
+  free(cache);
+}
@@ -0,0 +1,115 @@
+/* Translates the right hand side program into GLSL, so the direction
+   field can be evaluated in the vertex shader. The program becomes
+   `vec2 field(float x, float y)`, spliced between the two halves of
+   the field vertex shader in shaders.c. */
+
+#include <stdarg.h>
+
+typedef struct {
+  char *out;
+  size_t size, length;
+} glsl_writer_t;
+
+/* Append to the source, carrying on past the end of the buffer so
+   that overflow can be checked once at the end. */
+static void
+glsl_printf(glsl_writer_t *w, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  size_t start = w->length < w->size ? w->length : w->size;
+  int n = vsnprintf(w->out + start, w->size - start, format, args);
+  va_end(args);
+  if (n > 0)
+    w->length += n;
+}
+
+/* Float literals need a point or an exponent, and there is no literal
+   for infinities or NaN. */
+static void
+glsl_float(glsl_writer_t *w, float value) {
+  if (isnan(value)) {
+    glsl_printf(w, "(0.0/0.0)");
+    return;
+  }
+  if (isinf(value)) {
+    glsl_printf(w, value > 0 ? "(1.0/0.0)" : "(-1.0/0.0)");
+    return;
+  }
+
+  char literal[32];
+  snprintf(literal, sizeof(literal), "%.9g", value);
+  glsl_printf(w, strpbrk(literal, ".e") ? "(%s)" : "(%s.0)", literal);
+}
+
+/* Constants, x, y and parameters are written inline where they are
+   used rather than getting a variable of their own. */
+static void
+glsl_operand(glsl_writer_t *w, const program_t *program, int reg) {
+  const instruction_t *ins = &program->code[reg];
+  switch (ins->op) {
+  case OP_CONST: glsl_float(w, ins->value); break;
+  case OP_X:     glsl_printf(w, "x"); break;
+  case OP_Y:     glsl_printf(w, "y"); break;
+  case OP_PARAM: glsl_printf(w, "params[%d]", ins->a); break;
+  default:       glsl_printf(w, "r%d", reg); break;
+  }
+}
+
+static const char *
+glsl_function_name(opcode_t op) {
+  /* GLSL leaves pow undefined for negative bases */
+  if (op == OP_POW)
+    return "c_pow";
+  for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    if (builtins[i].op == op)
+      return builtins[i].name;
+  return NULL;
+}
+
+/* Write the field vertex shader for `program`, which must have dx/dt
+   and dy/dt as its first two outputs, up to the `main` chosen when it
+   is linked. Returns false if the source does not fit in `size`
+   bytes. */
+bool
+glsl_field_shader(const program_t *program, char *out, size_t size) {
+  glsl_writer_t w = { .out = out, .size = size };
+
+  glsl_printf(&w, "%s\nuniform float params[%d];\n",
+              field_vertex_shader_head, MAX_PARAMS);
+  glsl_printf(&w, "vec2 field(float x, float y) {\n");
+
+  for (int i = 0; i < program->length; i++) {
+    const instruction_t *ins = &program->code[i];
+    int arity = opcode_arity(ins->op);
+    if (arity == 0)
+      continue;
+
+    glsl_printf(&w, "  float r%d = ", i);
+    const char *infix = NULL;
+    switch (ins->op) {
+    case OP_NEG: glsl_printf(&w, "-"); break;
+    case OP_ADD: infix = " + "; break;
+    case OP_SUB: infix = " - "; break;
+    case OP_MUL: infix = " * "; break;
+    case OP_DIV: infix = " / "; break;
+    default:     glsl_printf(&w, "%s(", glsl_function_name(ins->op)); break;
+    }
+
+    glsl_operand(&w, program, ins->a);
+    if (arity == 2) {
+      glsl_printf(&w, "%s", infix ? infix : ", ");
+      glsl_operand(&w, program, ins->b);
+    }
+    if (ins->op != OP_NEG && !infix)
+      glsl_printf(&w, ")");
+    glsl_printf(&w, ";\n");
+  }
+
+  glsl_printf(&w, "  return vec2(");
+  glsl_operand(&w, program, program->outputs[0]);
+  glsl_printf(&w, ", ");
+  glsl_operand(&w, program, program->outputs[1]);
+  glsl_printf(&w, ");\n}\n%s", field_vertex_shader_tail);
+
+  return w.length < size;
+}
@@ -1,43 +1,361 @@
-/* TODO:
-   - Handle identifiers other than x and y. Q: These will be user-set
-     parameters. How will they set it?
+#include "lanes.c"
 
-   - Avoid reading the string at each run? How?
+static const struct {
+  const char *name;
+  opcode_t op;
+} builtins[] = {
+  { "sin", OP_SIN },
+  { "cos", OP_COS },
+  { "exp", OP_EXP },
+  { "log", OP_LOG },
+  { "tanh", OP_TANH },
+  { "sqrt", OP_SQRT },
+  { "pow", OP_POW },
+};
 
-   - Handle trig. functions
- */
+/* Number of register operands read by `op`. */
+int
+opcode_arity(opcode_t op) {
+  switch (op) {
+  case OP_NEG:
+  case OP_SIN: case OP_COS: case OP_EXP: case OP_LOG:
+  case OP_TANH: case OP_SQRT:
+    return 1;
+  case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV: case OP_POW:
+    return 2;
+  default:
+    return 0;
+  }
+}
+
+/* Scalar semantics of every operator; the interpreter, constant
+   folding and the libm path of the batched evaluator agree on these. */
+static inline float
+apply_op(opcode_t op, float a, float b) {
+  switch (op) {
+  case OP_NEG:  return -a;
+  case OP_ADD:  return a + b;
+  case OP_SUB:  return a - b;
+  case OP_MUL:  return a * b;
+  case OP_DIV:  return a / b;
+  case OP_SIN:  return sinf(a);
+  case OP_COS:  return cosf(a);
+  case OP_EXP:  return expf(a);
+  case OP_LOG:  return logf(a);
+  case OP_TANH: return tanhf(a);
+  case OP_SQRT: return sqrtf(a);
+  case OP_POW:  return powf(a, b);
+  default: return 0;
+  }
+}
+
+void
+expr_graph_init(expr_graph_t *graph) {
+  graph->num_nodes = 0;
+  graph->full = false;
+  memset(graph->buckets, 0xff, sizeof(graph->buckets));
+}
+
+static bool
+is_const(const expr_graph_t *graph, int node, float value) {
+  return (graph->nodes[node].op == OP_CONST &&
+          graph->nodes[node].value == value);
+}
+
+static uint32_t
+expr_hash(opcode_t op, int a, int b, float value) {
+  uint32_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+
+  uint32_t h = 2166136261u;
+  h = (h ^ op) * 16777619u;
+  h = (h ^ a) * 16777619u;
+  h = (h ^ b) * 16777619u;
+  h = (h ^ bits) * 16777619u;
+  return h;
+}
+
+/* Return the node for `op` applied to nodes `a` and `b` (or the
+   constant `value`), folding constants and reusing an existing node
+   whenever there is one. The multiplication by zero rule ignores
+   infinite and NaN operands, as is usual for symbolic algebra. */
+int
+expr_node(expr_graph_t *graph, opcode_t op, int a, int b, float value) {
+  expr_node_t *nodes = graph->nodes;
+  int arity = opcode_arity(op);
+
+  if (op == OP_CONST && value == 0)
+    value = 0;  /* -0 and 0 are the same constant */
+  if (arity < 2)
+    b = 0;
+  if (arity < 1 && op != OP_PARAM)
+    a = 0;
+  if (arity > 0)
+    value = 0;
+
+  if (arity > 0 && nodes[a].op == OP_CONST &&
+      (arity == 1 || nodes[b].op == OP_CONST))
+    return expr_node(graph, OP_CONST, 0, 0,
+                     apply_op(op, nodes[a].value, nodes[b].value));
+
+  switch (op) {
+  case OP_NEG:
+    if (nodes[a].op == OP_NEG)
+      return nodes[a].a;
+    break;
+  case OP_ADD:
+    if (is_const(graph, a, 0)) return b;
+    if (is_const(graph, b, 0)) return a;
+    break;
+  case OP_SUB:
+    if (is_const(graph, b, 0)) return a;
+    if (is_const(graph, a, 0)) return expr_node(graph, OP_NEG, b, 0, 0);
+    break;
+  case OP_MUL:
+    if (is_const(graph, a, 0) || is_const(graph, b, 0))
+      return expr_node(graph, OP_CONST, 0, 0, 0);
+    if (is_const(graph, a, 1)) return b;
+    if (is_const(graph, b, 1)) return a;
+    if (is_const(graph, a, -1)) return expr_node(graph, OP_NEG, b, 0, 0);
+    if (is_const(graph, b, -1)) return expr_node(graph, OP_NEG, a, 0, 0);
+    break;
+  case OP_DIV:
+    if (is_const(graph, b, 1)) return a;
+    if (is_const(graph, a, 0)) return expr_node(graph, OP_CONST, 0, 0, 0);
+    break;
+  case OP_POW:
+    /* Small constant powers are cheaper as multiplications */
+    if (is_const(graph, b, 0)) return expr_node(graph, OP_CONST, 0, 0, 1);
+    if (is_const(graph, b, 1)) return a;
+    if (is_const(graph, b, 0.5f)) return expr_node(graph, OP_SQRT, a, 0, 0);
+    if (is_const(graph, b, 2)) return expr_node(graph, OP_MUL, a, a, 0);
+    if (is_const(graph, b, 3))
+      return expr_node(graph, OP_MUL, expr_node(graph, OP_MUL, a, a, 0), a, 0);
+    if (is_const(graph, b, -1))
+      return expr_node(graph, OP_DIV, expr_node(graph, OP_CONST, 0, 0, 1), a, 0);
+    break;
+  default:
+    break;
+  }
+
+  /* Commutative operators get a canonical operand order */
+  if ((op == OP_ADD || op == OP_MUL) && a > b) {
+    int t = a;
+    a = b;
+    b = t;
+  }
+
+  uint32_t h = expr_hash(op, a, b, value) & (EXPR_HASH_SIZE - 1);
+  while (graph->buckets[h] >= 0) {
+    expr_node_t *n = &nodes[graph->buckets[h]];
+    if (n->op == op && n->a == a && n->b == b &&
+        memcmp(&n->value, &value, sizeof(value)) == 0)
+      return graph->buckets[h];
+    h = (h + 1) & (EXPR_HASH_SIZE - 1);
+  }
+
+  if (graph->num_nodes >= MAX_EXPR_NODES) {
+    graph->full = true;
+    return 0;
+  }
+
+  int node = graph->num_nodes++;
+  nodes[node].op = op;
+  nodes[node].a = a;
+  nodes[node].b = b;
+  nodes[node].value = value;
+  graph->buckets[h] = node;
+  return node;
+}
+
+/* Emit the nodes reachable from `roots` as a program with one output
+   per root. Returns false if they do not fit. */
+bool
+program_from_graph(program_t *program, const expr_graph_t *graph,
+                   const int *roots, int num_roots) {
+  bool live[MAX_EXPR_NODES] = {0};
+  int reg[MAX_EXPR_NODES];
+
+  if (num_roots > MAX_PROGRAM_OUTPUTS)
+    return false;
+
+  for (int i = 0; i < num_roots; i++)
+    live[roots[i]] = true;
+  for (int i = graph->num_nodes - 1; i >= 0; i--) {
+    if (!live[i])
+      continue;
+    int arity = opcode_arity(graph->nodes[i].op);
+    if (arity > 0)
+      live[graph->nodes[i].a] = true;
+    if (arity > 1)
+      live[graph->nodes[i].b] = true;
+  }
 
-float expression();
-void skip_white();
+  program_t compiled = { .length = 0, .num_outputs = num_roots };
+  for (int i = 0; i < graph->num_nodes; i++) {
+    if (!live[i])
+      continue;
+    if (compiled.length >= MAX_PROGRAM_LENGTH)
+      return false;
 
-static char tmp[32];
-static char *look;
+    const expr_node_t *n = &graph->nodes[i];
+    int arity = opcode_arity(n->op);
+    instruction_t *ins = &compiled.code[compiled.length];
+    ins->op = n->op;
+    ins->a = arity > 0 ? reg[n->a] : n->a;     /* a parameter slot */
+    ins->b = arity > 1 ? reg[n->b] : 0;
+    ins->value = n->value;
+    reg[i] = compiled.length++;
+  }
 
-struct {
-  float x,y;
-} env;
+  for (int i = 0; i < num_roots; i++)
+    compiled.outputs[i] = reg[roots[i]];
 
-void get_char() {
-  look++;
+  *program = compiled;
+  return true;
 }
 
-void abort() {
-  exit(1);
+/* Differentiate every node in the graph that existed on entry with
+   respect to `var` (OP_X or OP_Y), storing the derivative node of node
+   `i` in `deriv[i]`. Children come before parents, so one pass in
+   index order suffices. */
+void
+expr_graph_derivatives(expr_graph_t *graph, opcode_t var, int *deriv) {
+  int count = graph->num_nodes;
+  int zero = expr_node(graph, OP_CONST, 0, 0, 0);
+  int one = expr_node(graph, OP_CONST, 0, 0, 1);
+
+  for (int i = 0; i < count; i++) {
+    expr_node_t n = graph->nodes[i];
+    int arity = opcode_arity(n.op);
+    int da = arity > 0 ? deriv[n.a] : zero;
+    int db = arity > 1 ? deriv[n.b] : zero;
+
+    switch (n.op) {
+    case OP_X:
+    case OP_Y:
+      deriv[i] = n.op == var ? one : zero;
+      break;
+    case OP_NEG:
+      deriv[i] = expr_node(graph, OP_NEG, da, 0, 0);
+      break;
+    case OP_ADD:
+      deriv[i] = expr_node(graph, OP_ADD, da, db, 0);
+      break;
+    case OP_SUB:
+      deriv[i] = expr_node(graph, OP_SUB, da, db, 0);
+      break;
+    case OP_MUL:
+      deriv[i] = expr_node(graph, OP_ADD,
+                           expr_node(graph, OP_MUL, da, n.b, 0),
+                           expr_node(graph, OP_MUL, n.a, db, 0), 0);
+      break;
+    case OP_DIV: {
+      /* (a/b)' = (a' - (a/b) b') / b */
+      int num = expr_node(graph, OP_SUB, da,
+                          expr_node(graph, OP_MUL, i, db, 0), 0);
+      deriv[i] = expr_node(graph, OP_DIV, num, n.b, 0);
+    } break;
+    case OP_SIN:
+      deriv[i] = expr_node(graph, OP_MUL,
+                           expr_node(graph, OP_COS, n.a, 0, 0), da, 0);
+      break;
+    case OP_COS:
+      deriv[i] = expr_node(graph, OP_NEG,
+                           expr_node(graph, OP_MUL,
+                                     expr_node(graph, OP_SIN, n.a, 0, 0),
+                                     da, 0), 0, 0);
+      break;
+    case OP_EXP:
+      deriv[i] = expr_node(graph, OP_MUL, i, da, 0);
+      break;
+    case OP_LOG:
+      deriv[i] = expr_node(graph, OP_DIV, da, n.a, 0);
+      break;
+    case OP_TANH: {
+      /* (1 - tanh^2) a' */
+      int sech2 = expr_node(graph, OP_SUB, one,
+                            expr_node(graph, OP_MUL, i, i, 0), 0);
+      deriv[i] = expr_node(graph, OP_MUL, sech2, da, 0);
+    } break;
+    case OP_SQRT:
+      deriv[i] = expr_node(graph, OP_DIV, da,
+                           expr_node(graph, OP_MUL,
+                                     expr_node(graph, OP_CONST, 0, 0, 2),
+                                     i, 0), 0);
+      break;
+    case OP_POW: {
+      /* a^b (b' log a + b a'/a), or b a^(b-1) a' for constant b */
+      const expr_node_t *b = &graph->nodes[n.b];
+      if (b->op == OP_CONST) {
+        int lower = expr_node(graph, OP_POW, n.a,
+                              expr_node(graph, OP_CONST, 0, 0, b->value - 1),
+                              0);
+        deriv[i] = expr_node(graph, OP_MUL,
+                             expr_node(graph, OP_MUL, n.b, lower, 0), da, 0);
+      }
+      else {
+        int log_a = expr_node(graph, OP_LOG, n.a, 0, 0);
+        int inner = expr_node(graph, OP_ADD,
+                              expr_node(graph, OP_MUL, db, log_a, 0),
+                              expr_node(graph, OP_DIV,
+                                        expr_node(graph, OP_MUL, n.b, da, 0),
+                                        n.a, 0), 0);
+        deriv[i] = expr_node(graph, OP_MUL, i, inner, 0);
+      }
+    } break;
+    default:
+      deriv[i] = zero;
+    }
+  }
 }
 
-void expected(char *s) {
-  printf("%s expected\n", s);
-  abort();
+/* All parser state lives here, so equations can be compiled on any
+   thread. On error, parsing continues from an empty string and the
+   first message is kept. */
+typedef struct {
+  const char *look;
+  expr_graph_t *graph;
+
+  /* Parameters used so far, and the table they are replacing */
+  param_table_t *params;
+  const param_table_t *previous_params;
+
+  bool failed;
+  char message[64];
+} parser_t;
+
+int expression(parser_t *p);
+void skip_white(parser_t *p);
+
+void get_char(parser_t *p) {
+  p->look++;
 }
 
-void match(char x) {
-  if (*look == x) {
-    get_char();
-    skip_white();
+/* Fail with `message` as is, unless already failed, and stop
+   consuming input */
+void parse_error(parser_t *p, const char *message) {
+  if (!p->failed) {
+    p->failed = true;
+    snprintf(p->message, sizeof(p->message), "%s", message);
+  }
+  p->look = "";
+}
+
+void expected(parser_t *p, const char *s) {
+  char message[sizeof(p->message)];
+  snprintf(message, sizeof(message), "%s expected", s);
+  parse_error(p, message);
+}
+
+void match(parser_t *p, char x) {
+  if (*p->look == x) {
+    get_char(p);
+    skip_white(p);
   }
   else {
-    snprintf(tmp, 32, "%c", x);
-    expected(tmp);
+    char tmp[2] = { x, 0 };
+    expected(p, tmp);
   }
 }
 
@@ -59,9 +377,9 @@ bool is_white(char c) {
   return (c == ' ');
 }
 
-void skip_white() {
-  while (is_white(*look))
-    get_char();
+void skip_white(parser_t *p) {
+  while (is_white(*p->look))
+    get_char(p);
 }
 
 bool is_addop(char c) {
@@ -70,98 +388,360 @@ bool is_addop(char c) {
   return false;
 }
 
-float get_num() {
-  if (!(is_digit(*look) || *look == '-')) {
-    expected("float");
+int emit(parser_t *p, opcode_t op, int a, int b, float value) {
+  int node = expr_node(p->graph, op, a, b, value);
+  if (p->graph->full) {
+    expected(p, "shorter expression");
+    return 0;
+  }
+  return node;
+}
+
+float get_num(parser_t *p) {
+  if (!is_digit(*p->look)) {
+    expected(p, "float");
+    return 0;
   }
 
   char buf[16];
   int i = 0;
-  while (is_digit(*look) || *look == '.') {
-    buf[i++] = *look;
-    get_char();
+  while ((is_digit(*p->look) || *p->look == '.') && i < 15) {
+    buf[i++] = *p->look;
+    get_char(p);
   }
   buf[i] = 0;
-  skip_white();
+  skip_white(p);
   float ret = atof(buf);
   return ret;
 }
 
-char get_name() {
-  if (!is_alpha(*look))
-    expected("name");
-  char ret = *look;
-  get_char();
-  skip_white();
-  return ret;
+/* Read an identifier into `name`, failing if it is longer than
+   `size` - 1 characters. */
+void get_name(parser_t *p, char *name, size_t size) {
+  size_t i = 0;
+  if (!is_alpha(*p->look)) {
+    expected(p, "name");
+    name[0] = 0;
+    return;
+  }
+  while (is_alpha(*p->look) || is_digit(*p->look) || *p->look == '_') {
+    if (i + 1 == size) {
+      char message[sizeof(p->message)];
+      snprintf(message, sizeof(message), "name too long (max %d characters)",
+               (int)size - 1);
+      name[i] = 0;
+      parse_error(p, message);
+      return;
+    }
+    name[i++] = *p->look;
+    get_char(p);
+  }
+  name[i] = 0;
+  skip_white(p);
+}
+
+/* Index of parameter `name` in `params`, or -1 */
+int
+param_find(const param_table_t *params, const char *name) {
+  for (int i = 0; i < params->count; i++)
+    if (strcmp(params->names[i], name) == 0)
+      return i;
+  return -1;
+}
+
+/* Return the slot of parameter `name`, adding it to the table (with
+   its previous value, if it had one) on first use. */
+int param_slot(parser_t *p, const char *name) {
+  param_table_t *params = p->params;
+  int slot = param_find(params, name);
+  if (slot >= 0)
+    return slot;
+
+  if (params->count >= MAX_PARAMS) {
+    char message[sizeof(p->message)];
+    snprintf(message, sizeof(message), "too many parameters (max %d)",
+             MAX_PARAMS);
+    parse_error(p, message);
+    return 0;
+  }
+
+  slot = params->count++;
+  snprintf(params->names[slot], MAX_PARAM_NAME, "%s", name);
+
+  int previous = param_find(p->previous_params, name);
+  params->values[slot] =
+    previous >= 0 ? p->previous_params->values[previous] : 1.0f;
+
+  return slot;
 }
 
-float factor() {
-  float value;
-  float sign = 1.0;
+/* Parse the parenthesised arguments of a call to `op`. */
+int call(parser_t *p, opcode_t op) {
+  int a, b = 0;
 
-  if (*look == '-') {
-    sign = -1;
+  match(p, '(');
+  a = expression(p);
+  if (opcode_arity(op) == 2) {
+    match(p, ',');
+    b = expression(p);
   }
+  match(p, ')');
+
+  return emit(p, op, a, b, 0);
+}
+
+int factor(parser_t *p) {
+  int node;
 
-  if (*look == '(') {
-    match('(');
-    value = expression();
-    match(')');
-    return value;
+  if (*p->look == '-') {
+    match(p, '-');
+    return emit(p, OP_NEG, factor(p), 0, 0);
   }
-  else if (is_alpha(*look)) {
-    switch (*look) {
-    case 'x': {
-      value = env.x;
-    } break;
-    case 'y': {
-      value = env.y;
-    } break;
-    }
-    get_char();
-    skip_white();
+
+  if (*p->look == '(') {
+    match(p, '(');
+    node = expression(p);
+    match(p, ')');
+    return node;
+  }
+  else if (is_alpha(*p->look)) {
+    char name[MAX_PARAM_NAME];
+    get_name(p, name, sizeof(name));
+
+    if (strcmp(name, "x") == 0)
+      return emit(p, OP_X, 0, 0, 0);
+    if (strcmp(name, "y") == 0)
+      return emit(p, OP_Y, 0, 0, 0);
+
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+      if (strcmp(name, builtins[i].name) == 0)
+        return call(p, builtins[i].op);
+
+    node = emit(p, OP_PARAM, param_slot(p, name), 0, 0);
   }
   else {
-    value = get_num();
+    node = emit(p, OP_CONST, 0, 0, get_num(p));
   }
-  return sign*value;
+  return node;
 }
 
-float term() {
-  float value = factor();
-  while ((*look == '*') || (*look == '/')) {
-    switch (*look) {
+int term(parser_t *p) {
+  int node = factor(p);
+  while ((*p->look == '*') || (*p->look == '/')) {
+    switch (*p->look) {
     case '*': {
-      match('*');
-      value = value * factor();
+      match(p, '*');
+      node = emit(p, OP_MUL, node, factor(p), 0);
     } break;
     case '/': {
-      match('/');
-      value = value / factor();
+      match(p, '/');
+      node = emit(p, OP_DIV, node, factor(p), 0);
     } break;
     }
   }
 
-  return value;
+  return node;
 }
 
-float expression() {
-  float value;
+int expression(parser_t *p) {
+  int node;
 
-  value = term();
-  while (is_addop(*look)) {
-    switch(*look) {
+  node = term(p);
+  while (is_addop(*p->look)) {
+    switch(*p->look) {
     case '+': {
-      match('+');
-      value = value + term();
+      match(p, '+');
+      node = emit(p, OP_ADD, node, term(p), 0);
     } break;
     case '-': {
-      match('-');
-      value = value - term();
+      match(p, '-');
+      node = emit(p, OP_SUB, node, term(p), 0);
     } break;
     }
   }
 
-  return value;
+  return node;
+}
+
+/* Parse `src` into the parser's graph, returning its root node. */
+static int
+compile_output(parser_t *p, const char *src) {
+  p->look = src;
+  skip_white(p);
+
+  int node = expression(p);
+  if (*p->look != 0)
+    expected(p, "operator");
+
+  return node;
+}
+
+/* Compile the pair of equations into a program for dx/dt and dy/dt,
+   plus one that also yields their Jacobian, and the stop condition
+   `stop_eqn` (which may be empty) into a third. Called only when the
+   equations change. `params` is replaced by the parameters the
+   equations use, keeping the values of those it already had. On a
+   syntax error `system` and `params` are left untouched and the
+   message is copied to `error`. */
+bool
+compile_system(compiled_system_t *system, param_table_t *params,
+               const char *xeqn, const char *yeqn, const char *stop_eqn,
+               char *error, size_t error_size) {
+  int deriv_x[MAX_EXPR_NODES], deriv_y[MAX_EXPR_NODES];
+  expr_graph_t graph;
+  param_table_t used = { .count = 0 };
+  parser_t p = { .graph = &graph, .params = &used, .previous_params = params };
+  expr_graph_init(&graph);
+
+  int roots[JACOBIAN_NUM_OUTPUTS];
+  roots[JACOBIAN_F] = compile_output(&p, xeqn);
+  roots[JACOBIAN_G] = compile_output(&p, yeqn);
+  int stop_root = stop_eqn[0] ? compile_output(&p, stop_eqn) : -1;
+
+  compiled_system_t compiled;
+  compiled.stop.length = 0;
+  compiled.stop.num_outputs = 0;
+  if (!p.failed) {
+    expr_graph_derivatives(&graph, OP_X, deriv_x);
+    expr_graph_derivatives(&graph, OP_Y, deriv_y);
+    roots[JACOBIAN_FX] = deriv_x[roots[JACOBIAN_F]];
+    roots[JACOBIAN_FY] = deriv_y[roots[JACOBIAN_F]];
+    roots[JACOBIAN_GX] = deriv_x[roots[JACOBIAN_G]];
+    roots[JACOBIAN_GY] = deriv_y[roots[JACOBIAN_G]];
+
+    if (graph.full ||
+        !program_from_graph(&compiled.rhs, &graph, roots, 2) ||
+        !program_from_graph(&compiled.jacobian, &graph, roots,
+                            JACOBIAN_NUM_OUTPUTS) ||
+        (stop_root >= 0 &&
+         !program_from_graph(&compiled.stop, &graph, &stop_root, 1)))
+      expected(&p, "shorter expression");
+  }
+
+  if (p.failed) {
+    snprintf(error, error_size, "%s", p.message);
+    return false;
+  }
+
+  *system = compiled;
+  *params = used;
+  error[0] = 0;
+  return true;
+}
+
+void
+program_run(const program_t *program, const float *params,
+            float x, float y, float *outputs) {
+  float regs[MAX_PROGRAM_LENGTH];
+
+  for (int i = 0; i < program->length; i++) {
+    const instruction_t *ins = &program->code[i];
+    switch (ins->op) {
+    case OP_CONST: regs[i] = ins->value; break;
+    case OP_X:     regs[i] = x; break;
+    case OP_Y:     regs[i] = y; break;
+    case OP_PARAM: regs[i] = params[ins->a]; break;
+    case OP_NEG:   regs[i] = -regs[ins->a]; break;
+    case OP_ADD:   regs[i] = regs[ins->a] + regs[ins->b]; break;
+    case OP_SUB:   regs[i] = regs[ins->a] - regs[ins->b]; break;
+    case OP_MUL:   regs[i] = regs[ins->a] * regs[ins->b]; break;
+    case OP_DIV:   regs[i] = regs[ins->a] / regs[ins->b]; break;
+    default:
+      regs[i] = apply_op(ins->op, regs[ins->a], regs[ins->b]);
+    }
+  }
+
+  for (int i = 0; i < program->num_outputs; i++)
+    outputs[i] = regs[program->outputs[i]];
+}
+
+/* Library functions of one lane set, either with the vector kernels
+   or, when `fast_math` is off, with libm one lane at a time. */
+static lanef
+lanes_call(opcode_t op, bool fast_math, lanef a, lanef b) {
+  if (fast_math) {
+    switch (op) {
+    case OP_SIN:  return lanef_sin(a);
+    case OP_COS:  return lanef_cos(a);
+    case OP_EXP:  return lanef_exp(a);
+    case OP_LOG:  return lanef_log(a);
+    case OP_TANH: return lanef_tanh(a);
+    case OP_POW:  return lanef_pow(a, b);
+    default: break;
+    }
+  }
+
+  switch (op) {
+  case OP_SIN:  return lanef_map(sinf, a);
+  case OP_COS:  return lanef_map(cosf, a);
+  case OP_EXP:  return lanef_map(expf, a);
+  case OP_LOG:  return lanef_map(logf, a);
+  case OP_TANH: return lanef_map(tanhf, a);
+  case OP_POW:  return lanef_map2(powf, a, b);
+  default: return a;
+  }
+}
+
+static void
+program_run_lanes(const program_t *program, const float *params,
+                  bool fast_math, lanef x, lanef y, lanef *outputs) {
+  lanef regs[MAX_PROGRAM_LENGTH];
+
+  for (int i = 0; i < program->length; i++) {
+    const instruction_t *ins = &program->code[i];
+    switch (ins->op) {
+    case OP_CONST: regs[i] = lanef_set1(ins->value); break;
+    case OP_X:     regs[i] = x; break;
+    case OP_Y:     regs[i] = y; break;
+    case OP_PARAM: regs[i] = lanef_set1(params[ins->a]); break;
+    case OP_NEG:   regs[i] = lanef_neg(regs[ins->a]); break;
+    case OP_ADD:   regs[i] = lanef_add(regs[ins->a], regs[ins->b]); break;
+    case OP_SUB:   regs[i] = lanef_sub(regs[ins->a], regs[ins->b]); break;
+    case OP_MUL:   regs[i] = lanef_mul(regs[ins->a], regs[ins->b]); break;
+    case OP_DIV:   regs[i] = lanef_div(regs[ins->a], regs[ins->b]); break;
+    case OP_SQRT:  regs[i] = lanef_sqrt(regs[ins->a]); break;
+    default:
+      regs[i] = lanes_call(ins->op, fast_math, regs[ins->a], regs[ins->b]);
+    }
+  }
+
+  for (int i = 0; i < program->num_outputs; i++)
+    outputs[i] = regs[program->outputs[i]];
+}
+
+/* Evaluate `program` at `n` points given as separate x and y arrays,
+   writing output `k` of point `i` to `outputs[k][i]`. Instructions
+   are dispatched once per LANE_WIDTH points. `fast_math` selects the
+   polynomial kernels for library functions over per-lane libm calls. */
+void
+program_run_batch(const program_t *program, const float *params,
+                  bool fast_math, int n,
+                  const float *xs, const float *ys, float **outputs) {
+  lanef results[MAX_PROGRAM_OUTPUTS];
+  int i = 0;
+
+  for (; i + LANE_WIDTH <= n; i += LANE_WIDTH) {
+    program_run_lanes(program, params, fast_math, lanef_load(xs + i), lanef_load(ys + i),
+                      results);
+    for (int k = 0; k < program->num_outputs; k++)
+      lanef_store(outputs[k] + i, results[k]);
+  }
+
+  if (i < n) {
+    /* Pad the tail out to a full set of lanes */
+    float tail_x[LANE_WIDTH] = {0}, tail_y[LANE_WIDTH] = {0};
+    float tail_out[LANE_WIDTH];
+    for (int j = 0; j < n - i; j++) {
+      tail_x[j] = xs[i + j];
+      tail_y[j] = ys[i + j];
+    }
+
+    program_run_lanes(program, params, fast_math, lanef_load(tail_x), lanef_load(tail_y),
+                      results);
+    for (int k = 0; k < program->num_outputs; k++) {
+      lanef_store(tail_out, results[k]);
+      for (int j = 0; j < n - i; j++)
+        outputs[k][i + j] = tail_out[j];
+    }
+  }
 }
@@ -0,0 +1,93 @@
+#pragma once
+
+#define MAX_PROGRAM_LENGTH 512
+#define MAX_PROGRAM_OUTPUTS 6
+
+#define MAX_PARAMS 16
+#define MAX_PARAM_NAME 16
+
+typedef enum {
+  OP_CONST,
+  OP_X,
+  OP_Y,
+  OP_PARAM,                     /* operand `a` is the parameter slot */
+  OP_NEG,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_SIN,
+  OP_COS,
+  OP_EXP,
+  OP_LOG,
+  OP_TANH,
+  OP_SQRT,
+  OP_POW,
+} opcode_t;
+
+/* Register `i` of a program holds the result of `code[i]`, so
+   operands always refer to earlier instructions and a program is run
+   with a single forward pass. */
+typedef struct {
+  uint8_t op;
+  uint16_t a, b;
+  float value;
+} instruction_t;
+
+typedef struct {
+  int length;
+  int num_outputs;
+  uint16_t outputs[MAX_PROGRAM_OUTPUTS];
+  instruction_t code[MAX_PROGRAM_LENGTH];
+} program_t;
+
+/* Identifiers other than x, y and the built-in functions name
+   parameters. Each gets a slot in `values`, which programs read at run
+   time, so values can change without recompiling. */
+typedef struct {
+  int count;
+  char names[MAX_PARAMS][MAX_PARAM_NAME];
+  float values[MAX_PARAMS];
+} param_table_t;
+
+/* Outputs of a system's Jacobian program */
+enum {
+  JACOBIAN_F,                   /* dx/dt */
+  JACOBIAN_G,                   /* dy/dt */
+  JACOBIAN_FX, JACOBIAN_FY,     /* d(dx/dt)/dx, d(dx/dt)/dy */
+  JACOBIAN_GX, JACOBIAN_GY,     /* d(dy/dt)/dx, d(dy/dt)/dy */
+  JACOBIAN_NUM_OUTPUTS
+};
+
+/* Everything compiled from one pair of equations */
+typedef struct {
+  program_t rhs;
+  /* The right hand side together with its derivatives, sharing
+     subexpressions between them. */
+  program_t jacobian;
+  /* Ends a trajectory where its output is positive; has no outputs
+     when there is no stop condition */
+  program_t stop;
+} compiled_system_t;
+
+#define MAX_EXPR_NODES 2048
+#define EXPR_HASH_SIZE 4096
+
+/* Expressions are parsed into a DAG before being turned into a
+   program. Nodes are hash-consed, so identical subexpressions, within
+   or across equations, are the same node, and children always come
+   before their parents. */
+typedef struct {
+  uint8_t op;
+  uint16_t a, b;
+  float value;
+} expr_node_t;
+
+typedef struct {
+  int num_nodes;
+  bool full;
+  expr_node_t nodes[MAX_EXPR_NODES];
+
+  /* Open-addressed table of node indices, -1 when empty */
+  int16_t buckets[EXPR_HASH_SIZE];
+} expr_graph_t;
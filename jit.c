@@ -0,0 +1,400 @@
+/* Translates compiled programs into native x86-64 SSE code. Every
+   program register is kept in an xmm register for its whole lifetime;
+   programs that need more than the 14 available ones, or that call
+   library functions other than sqrt, are left to the interpreter. */
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define JIT_SUPPORTED 1
+#include <sys/mman.h>
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+#define JIT_BUFFER_SIZE (32*1024)
+#define JIT_MAX_CONSTANTS MAX_PROGRAM_LENGTH
+#define JIT_MAX_FIXUPS (4*MAX_PROGRAM_LENGTH)
+
+/* xmm0 and xmm1 always hold x and y */
+#define JIT_XMM_X 0
+#define JIT_XMM_Y 1
+#define JIT_NUM_XMM 16
+
+/* General purpose registers */
+#define RAX 0
+#define RCX 1
+#define RDX 2
+#define RSI 6
+#define RDI 7
+#define R8 8
+#define R9 9
+
+/* SSE opcodes, all in the 0x0F map */
+#define SSE_MOVU_LOAD 0x10
+#define SSE_MOVU_STORE 0x11
+#define SSE_MOVAPS 0x28
+#define SSE_SQRT 0x51
+#define SSE_XORPS 0x57
+#define SSE_ADD 0x58
+#define SSE_MUL 0x59
+#define SSE_SHUFPS 0xC6
+#define SSE_SUB 0x5C
+#define SSE_DIV 0x5E
+
+/* Scalar single precision prefix */
+#define SSE_SS 0xF3
+
+typedef struct {
+  uint8_t *code;
+  int length;
+  bool failed;
+
+  /* RIP-relative references into the constant pool, patched once the
+     pool's position is known */
+  struct {
+    int at, constant;
+  } fixups[JIT_MAX_FIXUPS];
+  int num_fixups;
+
+  float constants[JIT_MAX_CONSTANTS];
+  int num_constants;
+} jit_emitter_t;
+
+static void
+jit_byte(jit_emitter_t *e, uint8_t b) {
+  if (e->length >= JIT_BUFFER_SIZE) {
+    e->failed = true;
+    return;
+  }
+  e->code[e->length++] = b;
+}
+
+static void
+jit_u32(jit_emitter_t *e, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    jit_byte(e, (v >> (8*i)) & 0xFF);
+}
+
+static void
+jit_patch_u32(jit_emitter_t *e, int at, uint32_t v) {
+  for (int i = 0; i < 4; i++)
+    e->code[at + i] = (v >> (8*i)) & 0xFF;
+}
+
+static void
+jit_rex(jit_emitter_t *e, bool w, int reg, int index, int base) {
+  uint8_t rex = 0x40 | (w << 3) | ((reg >> 3) << 2) |
+    ((index >> 3) << 1) | (base >> 3);
+  if (rex != 0x40)
+    jit_byte(e, rex);
+}
+
+static void
+jit_modrm(jit_emitter_t *e, int mod, int reg, int rm) {
+  jit_byte(e, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+static int
+jit_constant(jit_emitter_t *e, float value) {
+  for (int i = 0; i < e->num_constants; i++)
+    if (memcmp(&e->constants[i], &value, sizeof(float)) == 0)
+      return i;
+
+  if (e->num_constants >= JIT_MAX_CONSTANTS) {
+    e->failed = true;
+    return 0;
+  }
+  e->constants[e->num_constants] = value;
+  return e->num_constants++;
+}
+
+/* op xmm_reg, xmm_rm */
+static void
+jit_sse_rr(jit_emitter_t *e, uint8_t prefix, uint8_t op, int reg, int rm) {
+  if (prefix)
+    jit_byte(e, prefix);
+  jit_rex(e, false, reg, 0, rm);
+  jit_byte(e, 0x0F);
+  jit_byte(e, op);
+  jit_modrm(e, 3, reg, rm);
+}
+
+/* op xmm_reg, [rip + constant] */
+static void
+jit_sse_const(jit_emitter_t *e, uint8_t prefix, uint8_t op, int reg,
+              float value) {
+  int constant = jit_constant(e, value);
+
+  if (prefix)
+    jit_byte(e, prefix);
+  jit_rex(e, false, reg, 0, 0);
+  jit_byte(e, 0x0F);
+  jit_byte(e, op);
+  jit_modrm(e, 0, reg, 5);
+
+  if (e->num_fixups >= JIT_MAX_FIXUPS) {
+    e->failed = true;
+    return;
+  }
+  e->fixups[e->num_fixups].at = e->length;
+  e->fixups[e->num_fixups].constant = constant;
+  e->num_fixups++;
+  jit_u32(e, 0);
+}
+
+/* op xmm_reg, [base + index] (or the store form) */
+static void
+jit_sse_indexed(jit_emitter_t *e, uint8_t prefix, uint8_t op, int reg,
+                int base, int index) {
+  if (prefix)
+    jit_byte(e, prefix);
+  jit_rex(e, false, reg, index, base);
+  jit_byte(e, 0x0F);
+  jit_byte(e, op);
+  jit_modrm(e, 0, reg, 4);
+  jit_modrm(e, 0, index, base);
+}
+
+/* op xmm_reg, [base + disp8] (or the store form) */
+static void
+jit_sse_disp8(jit_emitter_t *e, uint8_t prefix, uint8_t op, int reg,
+              int base, int8_t disp) {
+  if (prefix)
+    jit_byte(e, prefix);
+  jit_rex(e, false, reg, 0, base);
+  jit_byte(e, 0x0F);
+  jit_byte(e, op);
+  jit_modrm(e, 1, reg, base);
+  jit_byte(e, disp);
+}
+
+static int
+jit_alloc_xmm(jit_emitter_t *e, bool *busy) {
+  for (int r = 0; r < JIT_NUM_XMM; r++) {
+    if (!busy[r]) {
+      busy[r] = true;
+      return r;
+    }
+  }
+  e->failed = true;
+  return 0;
+}
+
+/* Emit the straight-line body of `program` with x in xmm0, y in xmm1
+   and the parameter vector pointed to by `params`, storing the xmm
+   register of each output in `output_xmm`. */
+static void
+jit_emit_body(jit_emitter_t *e, const program_t *program, bool packed,
+              int params, int *output_xmm) {
+  uint8_t prefix = packed ? 0 : SSE_SS;
+  int last_use[MAX_PROGRAM_LENGTH];
+  int xmm[MAX_PROGRAM_LENGTH];
+  bool busy[JIT_NUM_XMM] = { [JIT_XMM_X] = true, [JIT_XMM_Y] = true };
+
+  for (int i = 0; i < program->length; i++) {
+    const instruction_t *ins = &program->code[i];
+    last_use[i] = i;
+    int arity = opcode_arity(ins->op);
+    if (arity > 0)
+      last_use[ins->a] = i;
+    if (arity > 1)
+      last_use[ins->b] = i;
+  }
+  for (int i = 0; i < program->num_outputs; i++)
+    last_use[program->outputs[i]] = program->length;
+
+  for (int i = 0; i < program->length && !e->failed; i++) {
+    const instruction_t *ins = &program->code[i];
+    int arity = opcode_arity(ins->op);
+    int dst;
+
+    if (ins->op == OP_X) {
+      xmm[i] = JIT_XMM_X;
+      continue;
+    }
+    if (ins->op == OP_Y) {
+      xmm[i] = JIT_XMM_Y;
+      continue;
+    }
+
+    if (arity == 0) {
+      dst = jit_alloc_xmm(e, busy);
+    }
+    else {
+      /* Overwrite the first operand in place when this is its last
+         use, otherwise copy it to a fresh register. */
+      int a = xmm[ins->a];
+      if (last_use[ins->a] == i && a != JIT_XMM_X && a != JIT_XMM_Y) {
+        dst = a;
+      }
+      else {
+        dst = jit_alloc_xmm(e, busy);
+        jit_sse_rr(e, 0, SSE_MOVAPS, dst, a);
+      }
+    }
+
+    switch (ins->op) {
+    case OP_CONST:
+      jit_sse_const(e, prefix, SSE_MOVU_LOAD, dst, ins->value);
+      break;
+    case OP_PARAM:
+      jit_sse_disp8(e, SSE_SS, SSE_MOVU_LOAD, dst, params, 4*ins->a);
+      if (packed) {
+        jit_sse_rr(e, 0, SSE_SHUFPS, dst, dst);   /* broadcast */
+        jit_byte(e, 0);
+      }
+      break;
+    case OP_NEG:
+      jit_sse_const(e, 0, SSE_XORPS, dst, -0.0f);
+      break;
+    case OP_ADD: jit_sse_rr(e, prefix, SSE_ADD, dst, xmm[ins->b]); break;
+    case OP_SUB: jit_sse_rr(e, prefix, SSE_SUB, dst, xmm[ins->b]); break;
+    case OP_MUL: jit_sse_rr(e, prefix, SSE_MUL, dst, xmm[ins->b]); break;
+    case OP_DIV: jit_sse_rr(e, prefix, SSE_DIV, dst, xmm[ins->b]); break;
+    case OP_SQRT: jit_sse_rr(e, prefix, SSE_SQRT, dst, dst); break;
+    default:
+      /* Library functions stay with the interpreter */
+      e->failed = true;
+    }
+    xmm[i] = dst;
+
+    if (arity > 1 && last_use[ins->b] == i && xmm[ins->b] != dst &&
+        xmm[ins->b] != JIT_XMM_X && xmm[ins->b] != JIT_XMM_Y)
+      busy[xmm[ins->b]] = false;
+    if (last_use[i] == i)
+      busy[dst] = false;
+  }
+
+  if (e->failed)
+    return;
+  for (int i = 0; i < program->num_outputs; i++)
+    output_xmm[i] = xmm[program->outputs[i]];
+}
+
+/* void scalar(float x, float y, float *outputs, const float *params) */
+static void
+jit_emit_scalar(jit_emitter_t *e, const program_t *program) {
+  int output_xmm[MAX_PROGRAM_OUTPUTS] = {0};
+  jit_emit_body(e, program, false, RSI, output_xmm);
+
+  for (int i = 0; i < program->num_outputs; i++)
+    jit_sse_disp8(e, SSE_SS, SSE_MOVU_STORE, output_xmm[i], RDI, 4*i);
+  jit_byte(e, 0xC3);                      /* ret */
+}
+
+/* void packed(const float *xs, const float *ys, float **outputs, long n,
+                const float *params) */
+static void
+jit_emit_packed(jit_emitter_t *e, const program_t *program) {
+  int output_xmm[MAX_PROGRAM_OUTPUTS] = {0};
+
+  jit_byte(e, 0x31);                      /* xor eax, eax */
+  jit_modrm(e, 3, RAX, RAX);
+  jit_rex(e, true, 0, 0, RCX);            /* shl rcx, 2 */
+  jit_byte(e, 0xC1);
+  jit_modrm(e, 3, 4, RCX);
+  jit_byte(e, 2);
+
+  int loop = e->length;
+  jit_rex(e, true, RCX, 0, RAX);          /* cmp rax, rcx */
+  jit_byte(e, 0x39);
+  jit_modrm(e, 3, RCX, RAX);
+  jit_byte(e, 0x0F);                      /* jge done */
+  jit_byte(e, 0x8D);
+  int exit_jump = e->length;
+  jit_u32(e, 0);
+
+  jit_sse_indexed(e, 0, SSE_MOVU_LOAD, JIT_XMM_X, RDI, RAX);
+  jit_sse_indexed(e, 0, SSE_MOVU_LOAD, JIT_XMM_Y, RSI, RAX);
+  jit_emit_body(e, program, true, R8, output_xmm);
+  for (int i = 0; i < program->num_outputs; i++) {
+    jit_rex(e, true, R9, 0, RDX);          /* mov r9, [rdx + 8*i] */
+    jit_byte(e, 0x8B);
+    jit_modrm(e, 1, R9, RDX);
+    jit_byte(e, 8*i);
+    jit_sse_indexed(e, 0, SSE_MOVU_STORE, output_xmm[i], R9, RAX);
+  }
+
+  jit_rex(e, true, 0, 0, RAX);            /* add rax, 16 */
+  jit_byte(e, 0x83);
+  jit_modrm(e, 3, 0, RAX);
+  jit_byte(e, 16);
+  jit_byte(e, 0xE9);                      /* jmp loop */
+  jit_u32(e, loop - (e->length + 4));
+
+  if (!e->failed)
+    jit_patch_u32(e, exit_jump, e->length - (exit_jump + 4));
+  jit_byte(e, 0xC3);                      /* ret */
+}
+
+void
+jit_release(jit_code_t *jit) {
+#if JIT_SUPPORTED
+  if (jit->memory)
+    munmap(jit->memory, jit->size);
+#endif
+  jit->memory = NULL;
+  jit->size = 0;
+  jit->scalar = NULL;
+  jit->packed = NULL;
+}
+
+/* Compile both entry points of `program`, replacing any code already
+   in `jit`. Returns false if the program has to stay interpreted. */
+bool
+jit_compile(jit_code_t *jit, const program_t *program) {
+  jit_release(jit);
+
+#if JIT_SUPPORTED
+  jit_emitter_t e;
+  uint8_t *memory = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (memory == MAP_FAILED)
+    return false;
+
+  memset(&e, 0, sizeof(e));
+  e.code = memory;
+  jit_constant(&e, -0.0f);
+
+  int scalar = e.length;
+  jit_emit_scalar(&e, program);
+
+  int packed = e.length;
+  jit_emit_packed(&e, program);
+
+  /* Each constant is splatted across 16 aligned bytes so the packed
+     code can use it directly. */
+  while (e.length % 16)
+    jit_byte(&e, 0xCC);
+  int pool = e.length;
+  for (int i = 0; i < e.num_constants; i++)
+    for (int lane = 0; lane < 4; lane++) {
+      uint32_t bits;
+      memcpy(&bits, &e.constants[i], sizeof(bits));
+      jit_u32(&e, bits);
+    }
+
+  if (e.failed) {
+    munmap(memory, JIT_BUFFER_SIZE);
+    return false;
+  }
+
+  for (int i = 0; i < e.num_fixups; i++) {
+    int at = e.fixups[i].at;
+    jit_patch_u32(&e, at, pool + 16*e.fixups[i].constant - (at + 4));
+  }
+
+  if (mprotect(memory, JIT_BUFFER_SIZE, PROT_READ|PROT_EXEC) != 0) {
+    munmap(memory, JIT_BUFFER_SIZE);
+    return false;
+  }
+
+  jit->memory = memory;
+  jit->size = JIT_BUFFER_SIZE;
+  /* Object to function pointer conversion, as with dlsym() */
+  *(void **)&jit->scalar = memory + scalar;
+  *(void **)&jit->packed = memory + packed;
+  return true;
+#else
+  return false;
+#endif
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+typedef void (*jit_scalar_fn)(float x, float y, float *outputs,
+                              const float *params);
+/* `n` must be a multiple of 4 */
+typedef void (*jit_packed_fn)(const float *xs, const float *ys,
+                              float **outputs, long n, const float *params);
+
+typedef struct {
+  void *memory;
+  size_t size;
+
+  /* NULL when the program could not be compiled */
+  jit_scalar_fn scalar;
+  jit_packed_fn packed;
+} jit_code_t;
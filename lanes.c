@@ -0,0 +1,333 @@
+/* Packed float lanes for batched evaluation. The widest instruction
+   set enabled at compile time is used (e.g. build with -mavx2 for 8
+   lanes); SSE2 gives 4 lanes and anything else falls back to 1. */
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+#define LANE_WIDTH 8
+typedef __m256 lanef;
+typedef __m256i lanei;
+
+static inline lanef lanef_load(const float *p) { return _mm256_loadu_ps(p); }
+static inline void lanef_store(float *p, lanef a) { _mm256_storeu_ps(p, a); }
+static inline lanef lanef_set1(float v) { return _mm256_set1_ps(v); }
+static inline lanef lanef_add(lanef a, lanef b) { return _mm256_add_ps(a, b); }
+static inline lanef lanef_sub(lanef a, lanef b) { return _mm256_sub_ps(a, b); }
+static inline lanef lanef_mul(lanef a, lanef b) { return _mm256_mul_ps(a, b); }
+static inline lanef lanef_div(lanef a, lanef b) { return _mm256_div_ps(a, b); }
+static inline lanef lanef_sqrt(lanef a) { return _mm256_sqrt_ps(a); }
+static inline lanef lanef_min(lanef a, lanef b) { return _mm256_min_ps(a, b); }
+static inline lanef lanef_max(lanef a, lanef b) { return _mm256_max_ps(a, b); }
+static inline lanef lanef_and(lanef a, lanef b) { return _mm256_and_ps(a, b); }
+static inline lanef lanef_or(lanef a, lanef b) { return _mm256_or_ps(a, b); }
+static inline lanef lanef_xor(lanef a, lanef b) { return _mm256_xor_ps(a, b); }
+/* ~a & b */
+static inline lanef lanef_andnot(lanef a, lanef b) { return _mm256_andnot_ps(a, b); }
+static inline lanef lanef_lt(lanef a, lanef b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+static inline lanef lanef_le(lanef a, lanef b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+static inline lanef lanef_eq(lanef a, lanef b) { return _mm256_cmp_ps(a, b, _CMP_EQ_OQ); }
+
+static inline lanei lanei_set1(int v) { return _mm256_set1_epi32(v); }
+static inline lanei lanei_add(lanei a, lanei b) { return _mm256_add_epi32(a, b); }
+static inline lanei lanei_sub(lanei a, lanei b) { return _mm256_sub_epi32(a, b); }
+static inline lanei lanei_and(lanei a, lanei b) { return _mm256_and_si256(a, b); }
+static inline lanei lanei_andnot(lanei a, lanei b) { return _mm256_andnot_si256(a, b); }
+static inline lanei lanei_eq(lanei a, lanei b) { return _mm256_cmpeq_epi32(a, b); }
+static inline lanei lanei_shl(lanei a, int n) { return _mm256_slli_epi32(a, n); }
+static inline lanei lanei_shr(lanei a, int n) { return _mm256_srli_epi32(a, n); }
+static inline lanei lanei_sra(lanei a, int n) { return _mm256_srai_epi32(a, n); }
+static inline lanei lanef_round_to_int(lanef a) { return _mm256_cvtps_epi32(a); }
+static inline lanei lanef_trunc_to_int(lanef a) { return _mm256_cvttps_epi32(a); }
+static inline lanef lanei_to_float(lanei a) { return _mm256_cvtepi32_ps(a); }
+static inline lanef lanei_as_float(lanei a) { return _mm256_castsi256_ps(a); }
+static inline lanei lanef_as_int(lanef a) { return _mm256_castps_si256(a); }
+
+#elif defined(__SSE2__)
+#include <immintrin.h>
+
+#define LANE_WIDTH 4
+typedef __m128 lanef;
+typedef __m128i lanei;
+
+static inline lanef lanef_load(const float *p) { return _mm_loadu_ps(p); }
+static inline void lanef_store(float *p, lanef a) { _mm_storeu_ps(p, a); }
+static inline lanef lanef_set1(float v) { return _mm_set1_ps(v); }
+static inline lanef lanef_add(lanef a, lanef b) { return _mm_add_ps(a, b); }
+static inline lanef lanef_sub(lanef a, lanef b) { return _mm_sub_ps(a, b); }
+static inline lanef lanef_mul(lanef a, lanef b) { return _mm_mul_ps(a, b); }
+static inline lanef lanef_div(lanef a, lanef b) { return _mm_div_ps(a, b); }
+static inline lanef lanef_sqrt(lanef a) { return _mm_sqrt_ps(a); }
+static inline lanef lanef_min(lanef a, lanef b) { return _mm_min_ps(a, b); }
+static inline lanef lanef_max(lanef a, lanef b) { return _mm_max_ps(a, b); }
+static inline lanef lanef_and(lanef a, lanef b) { return _mm_and_ps(a, b); }
+static inline lanef lanef_or(lanef a, lanef b) { return _mm_or_ps(a, b); }
+static inline lanef lanef_xor(lanef a, lanef b) { return _mm_xor_ps(a, b); }
+/* ~a & b */
+static inline lanef lanef_andnot(lanef a, lanef b) { return _mm_andnot_ps(a, b); }
+static inline lanef lanef_lt(lanef a, lanef b) { return _mm_cmplt_ps(a, b); }
+static inline lanef lanef_le(lanef a, lanef b) { return _mm_cmple_ps(a, b); }
+static inline lanef lanef_eq(lanef a, lanef b) { return _mm_cmpeq_ps(a, b); }
+
+static inline lanei lanei_set1(int v) { return _mm_set1_epi32(v); }
+static inline lanei lanei_add(lanei a, lanei b) { return _mm_add_epi32(a, b); }
+static inline lanei lanei_sub(lanei a, lanei b) { return _mm_sub_epi32(a, b); }
+static inline lanei lanei_and(lanei a, lanei b) { return _mm_and_si128(a, b); }
+static inline lanei lanei_andnot(lanei a, lanei b) { return _mm_andnot_si128(a, b); }
+static inline lanei lanei_eq(lanei a, lanei b) { return _mm_cmpeq_epi32(a, b); }
+static inline lanei lanei_shl(lanei a, int n) { return _mm_slli_epi32(a, n); }
+static inline lanei lanei_shr(lanei a, int n) { return _mm_srli_epi32(a, n); }
+static inline lanei lanei_sra(lanei a, int n) { return _mm_srai_epi32(a, n); }
+static inline lanei lanef_round_to_int(lanef a) { return _mm_cvtps_epi32(a); }
+static inline lanei lanef_trunc_to_int(lanef a) { return _mm_cvttps_epi32(a); }
+static inline lanef lanei_to_float(lanei a) { return _mm_cvtepi32_ps(a); }
+static inline lanef lanei_as_float(lanei a) { return _mm_castsi128_ps(a); }
+static inline lanei lanef_as_int(lanef a) { return _mm_castps_si128(a); }
+
+#else
+
+#define LANE_WIDTH 1
+typedef float lanef;
+
+static inline lanef lanef_load(const float *p) { return *p; }
+static inline void lanef_store(float *p, lanef a) { *p = a; }
+static inline lanef lanef_set1(float v) { return v; }
+static inline lanef lanef_add(lanef a, lanef b) { return a + b; }
+static inline lanef lanef_sub(lanef a, lanef b) { return a - b; }
+static inline lanef lanef_mul(lanef a, lanef b) { return a * b; }
+static inline lanef lanef_div(lanef a, lanef b) { return a / b; }
+static inline lanef lanef_sqrt(lanef a) { return sqrtf(a); }
+static inline lanef lanef_neg(lanef a) { return -a; }
+
+/* A single lane gains nothing from polynomial kernels */
+static inline lanef lanef_exp(lanef a) { return expf(a); }
+static inline lanef lanef_log(lanef a) { return logf(a); }
+static inline lanef lanef_sin(lanef a) { return sinf(a); }
+static inline lanef lanef_cos(lanef a) { return cosf(a); }
+static inline lanef lanef_tanh(lanef a) { return tanhf(a); }
+static inline lanef lanef_pow(lanef a, lanef b) { return powf(a, b); }
+
+#endif
+
+/* Apply a libm function to each lane in turn */
+static inline lanef
+lanef_map(float (*f)(float), lanef a) {
+  float v[LANE_WIDTH];
+  lanef_store(v, a);
+  for (int i = 0; i < LANE_WIDTH; i++)
+    v[i] = f(v[i]);
+  return lanef_load(v);
+}
+
+static inline lanef
+lanef_map2(float (*f)(float, float), lanef a, lanef b) {
+  float u[LANE_WIDTH], v[LANE_WIDTH];
+  lanef_store(u, a);
+  lanef_store(v, b);
+  for (int i = 0; i < LANE_WIDTH; i++)
+    u[i] = f(u[i], v[i]);
+  return lanef_load(u);
+}
+
+#if LANE_WIDTH > 1
+
+/* Single precision kernels after Cephes, accurate to a few ulp over
+   the ranges that matter here; sin and cos lose accuracy for
+   arguments beyond about 8192. */
+
+static inline lanef
+lanef_neg(lanef a) {
+  return lanef_xor(a, lanef_set1(-0.0f));
+}
+
+static inline lanef
+lanef_abs(lanef a) {
+  return lanef_andnot(lanef_set1(-0.0f), a);
+}
+
+/* mask ? a : b */
+static inline lanef
+lanef_select(lanef mask, lanef a, lanef b) {
+  return lanef_or(lanef_and(mask, a), lanef_andnot(mask, b));
+}
+
+/* ((c[0]*x + c[1])*x + ...) + c[n-1] */
+static inline lanef
+lanef_poly(lanef x, const float *c, int n) {
+  lanef y = lanef_set1(c[0]);
+  for (int i = 1; i < n; i++)
+    y = lanef_add(lanef_mul(y, x), lanef_set1(c[i]));
+  return y;
+}
+
+static inline lanef
+lanef_exp(lanef x) {
+  static const float p[] = {
+    1.9875691500E-4f, 1.3981999507E-3f, 8.3334519073E-3f,
+    4.1665795894E-2f, 1.6666665459E-1f, 5.0000001201E-1f,
+  };
+  lanef overflow = lanef_lt(lanef_set1(88.72283935546875f), x);
+  lanef underflow = lanef_lt(x, lanef_set1(-103.972076f));
+  /* Constant first so that NaNs pass through */
+  x = lanef_min(lanef_set1(88.72283935546875f), x);
+  x = lanef_max(lanef_set1(-103.972076f), x);
+
+  /* x = n ln2 + r with |r| <= ln2/2 */
+  lanei n = lanef_round_to_int(lanef_mul(x, lanef_set1(1.44269504088896341f)));
+  lanef fn = lanei_to_float(n);
+  x = lanef_sub(x, lanef_mul(fn, lanef_set1(0.693359375f)));
+  x = lanef_sub(x, lanef_mul(fn, lanef_set1(-2.12194440e-4f)));
+
+  lanef z = lanef_mul(x, x);
+  lanef y = lanef_mul(lanef_poly(x, p, 6), z);
+  y = lanef_add(lanef_add(y, x), lanef_set1(1.0f));
+
+  /* Scale by 2^n in two halves so that neither overflows the exponent
+     near the ends of the range. */
+  lanei n1 = lanei_sra(n, 1);
+  lanei n2 = lanei_sub(n, n1);
+  y = lanef_mul(y, lanei_as_float(lanei_shl(lanei_add(n1, lanei_set1(127)), 23)));
+  y = lanef_mul(y, lanei_as_float(lanei_shl(lanei_add(n2, lanei_set1(127)), 23)));
+
+  y = lanef_select(overflow, lanef_set1(INFINITY), y);
+  return lanef_andnot(underflow, y);
+}
+
+static inline lanef
+lanef_log(lanef x) {
+  static const float p[] = {
+    7.0376836292E-2f, -1.1514610310E-1f, 1.1676998740E-1f,
+    -1.2420140846E-1f, 1.4249322787E-1f, -1.6668057665E-1f,
+    2.0000714765E-1f, -2.4999993993E-1f, 3.3333331174E-1f,
+  };
+  lanef invalid = lanef_andnot(lanef_le(lanef_set1(0.0f), x),
+                               lanei_as_float(lanei_set1(-1)));
+  lanef zero = lanef_eq(x, lanef_set1(0.0f));
+  lanef infinite = lanef_eq(x, lanef_set1(INFINITY));
+  x = lanef_max(x, lanef_set1(1.17549435e-38f));
+
+  /* x = m 2^e with m in [0.5, 1) */
+  lanei bits = lanef_as_int(x);
+  lanef e = lanei_to_float(lanei_sub(lanei_shr(bits, 23), lanei_set1(126)));
+  lanef m = lanei_as_float(lanei_and(bits, lanei_set1(0x007FFFFF)));
+  m = lanef_or(m, lanef_set1(0.5f));
+
+  /* Move m to [sqrt(1/2), sqrt(2)) and take log(1 + x) */
+  lanef small = lanef_lt(m, lanef_set1(0.707106781186547524f));
+  e = lanef_sub(e, lanef_and(small, lanef_set1(1.0f)));
+  x = lanef_add(lanef_sub(m, lanef_set1(1.0f)), lanef_and(small, m));
+
+  lanef z = lanef_mul(x, x);
+  lanef y = lanef_mul(lanef_poly(x, p, 9), lanef_mul(x, z));
+  y = lanef_add(y, lanef_mul(e, lanef_set1(-2.12194440e-4f)));
+  y = lanef_sub(y, lanef_mul(z, lanef_set1(0.5f)));
+  x = lanef_add(x, y);
+  x = lanef_add(x, lanef_mul(e, lanef_set1(0.693359375f)));
+
+  x = lanef_select(infinite, lanef_set1(INFINITY), x);
+  x = lanef_select(zero, lanef_set1(-INFINITY), x);
+  return lanef_or(x, invalid);    /* all bits set is a NaN */
+}
+
+/* Shared range reduction for sin and cos: x = j pi/4 + r, with j
+   even and |r| <= pi/4 for |x|. Returns r and sets `j`. */
+static inline lanef
+lanef_reduce_quarter_pi(lanef ax, lanei *j) {
+  lanef y = lanef_mul(ax, lanef_set1(1.27323954473516f));
+  *j = lanef_trunc_to_int(y);
+  *j = lanei_and(lanei_add(*j, lanei_set1(1)), lanei_set1(~1));
+  y = lanei_to_float(*j);
+
+  ax = lanef_add(ax, lanef_mul(y, lanef_set1(-0.78515625f)));
+  ax = lanef_add(ax, lanef_mul(y, lanef_set1(-2.4187564849853515625e-4f)));
+  ax = lanef_add(ax, lanef_mul(y, lanef_set1(-3.77489497744594108e-8f)));
+  return ax;
+}
+
+/* Evaluates both polynomials on the reduced argument and picks one
+   per lane. */
+static inline lanef
+lanef_sincos_poly(lanef r, lanef use_sin) {
+  static const float cos_p[] = {
+    2.443315711809948E-005f, -1.388731625493765E-003f,
+    4.166664568298827E-002f,
+  };
+  static const float sin_p[] = {
+    -1.9515295891E-4f, 8.3321608736E-3f, -1.6666654611E-1f,
+  };
+  lanef z = lanef_mul(r, r);
+
+  lanef c = lanef_mul(lanef_poly(z, cos_p, 3), lanef_mul(z, z));
+  c = lanef_sub(c, lanef_mul(z, lanef_set1(0.5f)));
+  c = lanef_add(c, lanef_set1(1.0f));
+
+  lanef s = lanef_mul(lanef_poly(z, sin_p, 3), lanef_mul(z, r));
+  s = lanef_add(s, r);
+
+  return lanef_select(use_sin, s, c);
+}
+
+static inline lanef
+lanef_sin(lanef x) {
+  lanef sign = lanef_and(x, lanef_set1(-0.0f));
+  lanei j;
+  lanef r = lanef_reduce_quarter_pi(lanef_abs(x), &j);
+
+  sign = lanef_xor(sign, lanei_as_float(lanei_shl(lanei_and(j, lanei_set1(4)), 29)));
+  lanef use_sin = lanei_as_float(lanei_eq(lanei_and(j, lanei_set1(2)),
+                                          lanei_set1(0)));
+  return lanef_xor(lanef_sincos_poly(r, use_sin), sign);
+}
+
+static inline lanef
+lanef_cos(lanef x) {
+  lanei j;
+  lanef r = lanef_reduce_quarter_pi(lanef_abs(x), &j);
+
+  j = lanei_sub(j, lanei_set1(2));
+  lanef sign = lanei_as_float(lanei_shl(lanei_andnot(j, lanei_set1(4)), 29));
+  lanef use_sin = lanei_as_float(lanei_eq(lanei_and(j, lanei_set1(2)),
+                                          lanei_set1(0)));
+  return lanef_xor(lanef_sincos_poly(r, use_sin), sign);
+}
+
+static inline lanef
+lanef_tanh(lanef x) {
+  static const float p[] = {
+    -5.70498872745E-3f, 2.06390887954E-2f, -5.37397155531E-2f,
+    1.33314422036E-1f, -3.33332819422E-1f,
+  };
+  lanef ax = lanef_abs(x);
+  lanef sign = lanef_and(x, lanef_set1(-0.0f));
+
+  /* Near zero use the odd polynomial, elsewhere (1 - e) / (1 + e)
+     with e = exp(-2|x|). */
+  lanef z = lanef_mul(x, x);
+  lanef near = lanef_add(x, lanef_mul(lanef_mul(x, z), lanef_poly(z, p, 5)));
+
+  lanef e = lanef_exp(lanef_mul(ax, lanef_set1(-2.0f)));
+  lanef far = lanef_div(lanef_sub(lanef_set1(1.0f), e),
+                        lanef_add(lanef_set1(1.0f), e));
+  far = lanef_or(far, sign);
+
+  return lanef_select(lanef_lt(ax, lanef_set1(0.625f)), near, far);
+}
+
+/* exp(b log|a|), with the sign fixed up for negative bases raised to
+   integer powers as powf() does. */
+static inline lanef
+lanef_pow(lanef a, lanef b) {
+  lanef result = lanef_exp(lanef_mul(b, lanef_log(lanef_abs(a))));
+
+  lanei n = lanef_round_to_int(b);
+  lanef integral = lanef_eq(lanei_to_float(n), b);
+  lanef odd = lanei_as_float(lanei_shl(lanei_and(n, lanei_set1(1)), 31));
+  lanef negative = lanef_lt(a, lanef_set1(0.0f));
+
+  lanef signed_result = lanef_select(integral, lanef_xor(result, odd),
+                                     lanef_set1(NAN));
+  result = lanef_select(negative, signed_result, result);
+  return lanef_select(lanef_eq(b, lanef_set1(0.0f)), lanef_set1(1.0f), result);
+}
+
+#endif
@@ -0,0 +1,107 @@
+/* A fixed set of worker threads for running parallel loops. Indices
+   are handed out one at a time from an atomic counter, so tasks of
+   uneven length balance themselves. */
+
+static void
+thread_pool_work(thread_pool_t *pool, int worker) {
+  for (;;) {
+    int index = SDL_AtomicAdd(&pool->next, 1);
+    if (index >= pool->count)
+      break;
+    pool->fn(pool->data, index, worker);
+  }
+}
+
+static int
+thread_pool_thread(void *data) {
+  pool_worker_t *worker = data;
+  thread_pool_t *pool = worker->pool;
+  int generation = 0;
+
+  SDL_LockMutex(pool->mutex);
+  for (;;) {
+    while (pool->generation == generation && !pool->quit)
+      SDL_CondWait(pool->start, pool->mutex);
+    if (pool->quit)
+      break;
+    generation = pool->generation;
+
+    SDL_UnlockMutex(pool->mutex);
+    thread_pool_work(pool, worker->index);
+    SDL_LockMutex(pool->mutex);
+
+    if (--pool->active == 0)
+      SDL_CondSignal(pool->done);
+  }
+  SDL_UnlockMutex(pool->mutex);
+  return 0;
+}
+
+/* Start `num_threads` workers; the thread calling thread_pool_run()
+   works too, so 0 runs loops serially. */
+void
+thread_pool_init(thread_pool_t *pool, int num_threads) {
+  if (num_threads > MAX_WORKERS - 1)
+    num_threads = MAX_WORKERS - 1;
+  if (num_threads < 0)
+    num_threads = 0;
+
+  pool->mutex = SDL_CreateMutex();
+  pool->start = SDL_CreateCond();
+  pool->done = SDL_CreateCond();
+  pool->generation = 0;
+  pool->count = 0;
+  pool->active = 0;
+  pool->quit = false;
+
+  pool->num_threads = 0;
+  for (int i = 0; i < num_threads; i++) {
+    pool_worker_t *worker = &pool->workers[i];
+    worker->pool = pool;
+    worker->index = i + 1;
+    pool->threads[i] = SDL_CreateThread(thread_pool_thread, "worker", worker);
+    if (!pool->threads[i])
+      break;
+    pool->num_threads++;
+  }
+}
+
+/* Call `fn` for every index in [0, count), returning when all calls
+   have. Must only be called from one thread. */
+void
+thread_pool_run(thread_pool_t *pool, int count, pool_task_fn fn, void *data) {
+  if (count <= 0)
+    return;
+
+  SDL_LockMutex(pool->mutex);
+  pool->fn = fn;
+  pool->data = data;
+  pool->count = count;
+  SDL_AtomicSet(&pool->next, 0);
+  pool->active = pool->num_threads;
+  pool->generation++;
+  SDL_CondBroadcast(pool->start);
+  SDL_UnlockMutex(pool->mutex);
+
+  thread_pool_work(pool, 0);
+
+  SDL_LockMutex(pool->mutex);
+  while (pool->active > 0)
+    SDL_CondWait(pool->done, pool->mutex);
+  SDL_UnlockMutex(pool->mutex);
+}
+
+void
+thread_pool_destroy(thread_pool_t *pool) {
+  SDL_LockMutex(pool->mutex);
+  pool->quit = true;
+  SDL_CondBroadcast(pool->start);
+  SDL_UnlockMutex(pool->mutex);
+
+  for (int i = 0; i < pool->num_threads; i++)
+    SDL_WaitThread(pool->threads[i], NULL);
+
+  SDL_DestroyCond(pool->done);
+  SDL_DestroyCond(pool->start);
+  SDL_DestroyMutex(pool->mutex);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#define MAX_WORKERS 64
+
+/* Called for each index of a parallel loop. `worker` is in
+   [0, num_threads] and no two calls with the same `worker` run at the
+   same time, so it can select per-thread state. */
+typedef void (*pool_task_fn)(void *data, int index, int worker);
+
+typedef struct thread_pool thread_pool_t;
+
+typedef struct {
+  thread_pool_t *pool;
+  int index;
+} pool_worker_t;
+
+struct thread_pool {
+  int num_threads;
+  SDL_Thread *threads[MAX_WORKERS];
+  pool_worker_t workers[MAX_WORKERS];
+
+  SDL_mutex *mutex;
+  SDL_cond *start, *done;
+
+  /* The loop being run, started when `generation` changes */
+  int generation;
+  pool_task_fn fn;
+  void *data;
+  int count;
+  SDL_atomic_t next;
+
+  /* Threads still working on the current loop */
+  int active;
+  bool quit;
+};
@@ -1,6 +1,10 @@
+/* For MAP_ANONYMOUS in jit.c */
+#define _DEFAULT_SOURCE
+
 #include <stdbool.h>
 #include <stdint.h>
 #include <math.h>
+#include <float.h>
 
 #include <GL/gl3w.h>
 
@@ -22,33 +26,261 @@
 #include "shaders.c"
 #include "solver.c"
 #include "interpreter.c"
+#include "jit.c"
+#include "glsl.c"
+#include "cache.c"
+#include "pool.c"
+#include "arena.c"
 
 
 #define WIDTH 800
 #define HEIGHT 600
 
+/* Longest the main loop sleeps while the solver is busy */
+#define WAKE_TIMEOUT_MS 250
+
 #define MAX_VERTEX_MEMORY 512 * 1024
 #define MAX_ELEMENT_MEMORY 128 * 1024
 
-static const int num_rows = 20;
-static const int num_columns = 20;
+/* Field evaluations timed by each pass of compare_evaluators() */
+#define COMPARE_EVALUATIONS 400000
 
-vec2
-diffeq_system(pplane_state_t *pplane_state, vec2 current) {
-  vec2 result;
+/* Rows and columns of arrows the field can be set to */
+#define MIN_GRID_SIZE 10
+#define MAX_GRID_SIZE 1000
 
-  env.x = current.x;
-  env.y = current.y;
+/* Grid arrays are padded to whole lanes so the batched passes over
+   them need no tail handling. */
+static int
+grid_padded_size(int num_grid_points) {
+  return (num_grid_points + LANE_WIDTH - 1) / LANE_WIDTH * LANE_WIDTH;
+}
 
-  look = pplane_state->xeqn;
-  result.x = expression();
+static void
+eval_context_init(eval_context_t *ctx, pplane_state_t *pplane_state,
+                  bool use_jit) {
+  compiled_entry_t *compiled = pplane_state->compiled;
+  ctx->program = &compiled->system.rhs;
+  ctx->jacobian = &compiled->system.jacobian;
+  ctx->stop = &compiled->system.stop;
+  ctx->params = pplane_state->params.values;
+  ctx->jit_scalar = use_jit ? compiled->jit.scalar : NULL;
+  ctx->jit_packed = use_jit ? compiled->jit.packed : NULL;
+  ctx->jacobian_jit_scalar = use_jit ? compiled->jacobian_jit.scalar : NULL;
+  ctx->fast_math = pplane_state->fast_math;
+}
 
-  look = pplane_state->yeqn;
-  result.y = expression();
+vec2
+diffeq_system(const eval_context_t *ctx, vec2 current) {
+  float derivs[2];
+  if (ctx->jit_scalar)
+    ctx->jit_scalar(current.x, current.y, derivs, ctx->params);
+  else
+    program_run(ctx->program, ctx->params, current.x, current.y, derivs);
+
+  vec2 result = { .x = derivs[0], .y = derivs[1] };
+  return result;
+}
 
+/* Evaluate the system and its Jacobian, `jacobian[i][j]` being the
+   derivative of component i with respect to variable j. */
+vec2
+diffeq_jacobian(const eval_context_t *ctx, vec2 current,
+                float jacobian[2][2]) {
+  float outputs[JACOBIAN_NUM_OUTPUTS];
+  if (ctx->jacobian_jit_scalar)
+    ctx->jacobian_jit_scalar(current.x, current.y, outputs, ctx->params);
+  else
+    program_run(ctx->jacobian, ctx->params, current.x, current.y, outputs);
+
+  jacobian[0][0] = outputs[JACOBIAN_FX];
+  jacobian[0][1] = outputs[JACOBIAN_FY];
+  jacobian[1][0] = outputs[JACOBIAN_GX];
+  jacobian[1][1] = outputs[JACOBIAN_GY];
+
+  vec2 result = { .x = outputs[JACOBIAN_F], .y = outputs[JACOBIAN_G] };
   return result;
 }
 
+/* Whether the user's stop condition holds at `current` */
+bool
+diffeq_stops(const eval_context_t *ctx, vec2 current) {
+  if (ctx->stop->num_outputs == 0)
+    return false;
+
+  float value;
+  program_run(ctx->stop, ctx->params, current.x, current.y, &value);
+  return value > 0;
+}
+
+/* Batched counterpart of diffeq_system(). */
+void
+diffeq_system_batch(const eval_context_t *ctx, int n,
+                    const float *xs, const float *ys, float **derivs) {
+  int done = 0;
+  if (ctx->jit_packed) {
+    done = n & ~3;
+    ctx->jit_packed(xs, ys, derivs, done, ctx->params);
+  }
+
+  if (done < n) {
+    float *rest[2] = { derivs[0] + done, derivs[1] + done };
+    program_run_batch(ctx->program, ctx->params, ctx->fast_math, n - done,
+                      xs + done, ys + done, rest);
+  }
+}
+
+/* Returns false, keeping the previous system, if the equations do not
+   parse. Equations compiled recently are taken from the cache. */
+static bool
+compile_equations(pplane_state_t *pplane_state) {
+  /* Room for the whole of each equation */
+  char xeqn[sizeof(pplane_state->xeqn)];
+  char yeqn[sizeof(pplane_state->yeqn)];
+  char stop_eqn[sizeof(pplane_state->stop_eqn)];
+  if (!normalise_equation(xeqn, sizeof(xeqn), pplane_state->xeqn) ||
+      !normalise_equation(yeqn, sizeof(yeqn), pplane_state->yeqn) ||
+      !normalise_equation(stop_eqn, sizeof(stop_eqn), pplane_state->stop_eqn)) {
+    snprintf(pplane_state->eqn_error, sizeof(pplane_state->eqn_error),
+             "equation too long");
+    return false;
+  }
+  uint64_t key = compile_cache_key(xeqn, yeqn, stop_eqn);
+
+  compiled_entry_t *previous = pplane_state->compiled;
+  compiled_entry_t *entry =
+    compile_cache_find(pplane_state->compile_cache, key,
+                       xeqn, yeqn, stop_eqn);
+
+  if (entry) {
+    /* Parameters shared with the current system keep their values */
+    for (int i = 0; i < entry->params.count; i++) {
+      int slot = param_find(&pplane_state->params, entry->params.names[i]);
+      if (slot >= 0)
+        entry->params.values[i] = pplane_state->params.values[slot];
+    }
+  }
+  else {
+    compiled_system_t system;
+    param_table_t params = pplane_state->params;
+    if (!compile_system(&system, &params, xeqn, yeqn, stop_eqn,
+                        pplane_state->eqn_error,
+                        sizeof(pplane_state->eqn_error)))
+      return false;
+
+    entry = compile_cache_evict(pplane_state->compile_cache);
+    entry->key = key;
+    memcpy(entry->xeqn, xeqn, sizeof(xeqn));
+    memcpy(entry->yeqn, yeqn, sizeof(yeqn));
+    memcpy(entry->stop_eqn, stop_eqn, sizeof(stop_eqn));
+    entry->system = system;
+    entry->params = params;
+
+    /* A failure leaves the interpreter in use; the UI says so */
+    jit_compile(&entry->jit, &entry->system.rhs);
+    jit_compile(&entry->jacobian_jit, &entry->system.jacobian);
+
+    entry->field_shader_ok =
+      glsl_field_shader(&entry->system.rhs, entry->field_shader_src,
+                        sizeof(entry->field_shader_src));
+  }
+
+  if (previous)
+    previous->params = pplane_state->params;
+  pplane_state->params = entry->params;
+  pplane_state->eqn_error[0] = 0;
+
+  entry->last_used = ++pplane_state->compile_clock;
+  pplane_state->compiled = entry;
+  if (entry != previous) {
+    pplane_state->comparison[0][0] = 0;
+    pplane_state->field_shader_changed = true;
+    pplane_state->dirty |= DIRTY_SYSTEM;
+  }
+  return true;
+}
+
+/* Run the field and an RK4 trajectory through both the interpreter
+   and the JIT, leaving the timings and largest differences in
+   `comparison`. Only offered when the system has been JIT compiled. */
+static void
+compare_evaluators(pplane_state_t *pplane_state) {
+  /* A grid like the field's, in real coordinates, evaluated into
+     arrays of its own so the field is left alone */
+  int num_rows = pplane_state->num_rows;
+  int num_columns = pplane_state->num_columns;
+  int n = grid_padded_size(num_rows*num_columns);
+  float *buffer = calloc(6 * n, sizeof(float));
+  if (!buffer)
+    return;
+  float *xs = buffer, *ys = buffer + n;
+  float *derivs[2][2] = {
+    { buffer + 2*n, buffer + 3*n },   /* interpreter */
+    { buffer + 4*n, buffer + 5*n },   /* JIT */
+  };
+
+  float step_x = (pplane_state->maxX - pplane_state->minX) / num_rows;
+  float step_y = (pplane_state->maxY - pplane_state->minY) / num_columns;
+  for (int i = 0; i < num_rows; i++) {
+    for (int j = 0; j < num_columns; j++) {
+      xs[i*num_columns + j] = pplane_state->minX + i*step_x;
+      ys[i*num_columns + j] = pplane_state->minY + j*step_y;
+    }
+  }
+
+  /* Roughly the same work whatever the grid size */
+  int repeats = COMPARE_EVALUATIONS / n;
+  if (repeats < 1)
+    repeats = 1;
+  double seconds[2];
+  eval_context_t contexts[2];
+  eval_context_init(&contexts[0], pplane_state, false);
+  eval_context_init(&contexts[1], pplane_state, true);
+
+  for (int pass = 0; pass < 2; pass++) {
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int r = 0; r < repeats; r++)
+      diffeq_system_batch(&contexts[pass], n, xs, ys, derivs[pass]);
+    seconds[pass] = (double)(SDL_GetPerformanceCounter() - start) /
+      SDL_GetPerformanceFrequency();
+  }
+
+  float max_error = 0;
+  for (int i = 0; i < n; i++) {
+    float ex = fabsf(derivs[1][0][i] - derivs[0][0][i]);
+    float ey = fabsf(derivs[1][1][i] - derivs[0][1][i]);
+    if (ex > max_error) max_error = ex;
+    if (ey > max_error) max_error = ey;
+  }
+  double field_ms[2] = {
+    1000*seconds[0] / repeats, 1000*seconds[1] / repeats
+  };
+
+  vec2 ends[2];
+  for (int pass = 0; pass < 2; pass++) {
+    vec2 current = { .x = 0.1f, .y = 0.1f };
+    Uint64 start = SDL_GetPerformanceCounter();
+    for (int i = 0; i < HALF_NUM_STEPS_PER_SOLUTION; i++)
+      current = rk4(&contexts[pass], current, SOLUTION_DT);
+    seconds[pass] = (double)(SDL_GetPerformanceCounter() - start) /
+      SDL_GetPerformanceFrequency();
+    ends[pass] = current;
+  }
+  float end_error = fmaxf(fabsf(ends[1].x - ends[0].x),
+                          fabsf(ends[1].y - ends[0].y));
+
+  /* Short lines, to fit the System window */
+  char (*lines)[40] = pplane_state->comparison;
+  size_t size = sizeof(pplane_state->comparison[0]);
+  snprintf(lines[0], size, "Interpreter / JIT, ms:");
+  snprintf(lines[1], size, "Field %.3g / %.3g", field_ms[0], field_ms[1]);
+  snprintf(lines[2], size, "RK4 %.3g / %.3g",
+           1000*seconds[0], 1000*seconds[1]);
+  snprintf(lines[3], size, "Differ by %.2g, %.2g", max_error, end_error);
+
+  free(buffer);
+}
+
 vec2
 unit_vector(vec2 v) {
   float m = sqrt(v.x*v.x + v.y*v.y);
@@ -77,16 +309,19 @@ show_info_log(GLuint object,
 
 
 GLuint
-create_shader(GLenum type, const GLchar *src) {
+create_shader_parts(GLenum type, int count, const GLchar **src) {
   GLuint shader = glCreateShader(type);
-  glShaderSource(shader, 1, &src, NULL);
+  glShaderSource(shader, count, src, NULL);
   glCompileShader(shader);
 
   GLint shader_ok;
   /* Check that shader compiled properly */
   glGetShaderiv(shader, GL_COMPILE_STATUS, &shader_ok);
   if (!shader_ok) {
-    fprintf(stderr, "Failed to compile %s:\n", src);
+    fprintf(stderr, "Failed to compile");
+    for (int i = 0; i < count; i++)
+      fprintf(stderr, " %s", src[i]);
+    fprintf(stderr, ":\n");
     show_info_log(shader, glGetShaderiv, glGetShaderInfoLog);
     glDeleteShader(shader);
     return 0;
@@ -95,6 +330,11 @@ create_shader(GLenum type, const GLchar *src) {
   return shader;
 }
 
+static GLuint
+create_shader(GLenum type, const GLchar *src) {
+  return create_shader_parts(type, 1, &src);
+}
+
 int
 create_axes_gl_state(pplane_state_t *pplane_state) {
   gl_state_t *gl_state = pplane_state->gl_state;
@@ -123,6 +363,8 @@ create_axes_gl_state(pplane_state_t *pplane_state) {
                         GL_FALSE, 0, 0);
   gl_state->axes.uniforms.scale =
     glGetUniformLocation(gl_state->axes.shader_program, "scale_factor");
+  gl_state->axes.uniforms.translate =
+    glGetUniformLocation(gl_state->axes.shader_program, "translate");
 
   return 0;
 }
@@ -144,9 +386,10 @@ create_solutions_gl_state(pplane_state_t *pplane_state) {
 
   glGenBuffers(1, &gl_state->solutions.vbo);
 
+  /* Sized to the arena when there are solutions to draw */
   glBindBuffer(GL_ARRAY_BUFFER, gl_state->solutions.vbo);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(gl_state->solutions.solutions),
-               gl_state->solutions.solutions, GL_STATIC_DRAW);
+  glBufferData(GL_ARRAY_BUFFER, 0, NULL, GL_DYNAMIC_DRAW);
+  gl_state->solutions.vbo_capacity = 0;
 
   gl_state->solutions.attributes.pos =
     glGetAttribLocation(gl_state->solutions.shader_program, "pos");
@@ -155,10 +398,84 @@ create_solutions_gl_state(pplane_state_t *pplane_state) {
                         GL_FALSE, 0, 0);
   gl_state->solutions.uniforms.scale =
     glGetUniformLocation(gl_state->solutions.shader_program, "scale_factor");
+  gl_state->solutions.uniforms.translate =
+    glGetUniformLocation(gl_state->solutions.shader_program, "translate");
 
   return 0;
 }
 
+/* A line strip from the tail to the tip and out to each barb of the
+   arrowhead, 30 degrees either side of the shaft; see
+   arrow_mesh_shader_src. */
+#define ARROW_MESH_LENGTH 5
+#define ARROW_MESH_ATTRIBUTE 0
+
+static const float arrow_mesh[ARROW_MESH_LENGTH][3] = {
+  { 0.0f,  0.0f,       0.0f },
+  { 1.0f,  0.0f,       0.0f },
+  { 1.0f, -0.8660254f, 0.5f },
+  { 1.0f,  0.0f,       0.0f },
+  { 1.0f, -0.8660254f, -0.5f },
+};
+
+/* The instanced arrow program and its buffers; the plane's `vbo` must
+   exist. Leaves `arrow_program` 0 if the program cannot be built. */
+static void
+create_arrow_gl_resources(gl_state_t *gl_state) {
+  const GLchar *src[] = { arrow_vertex_shader_src, arrow_mesh_shader_src };
+  GLuint shader = create_shader_parts(GL_VERTEX_SHADER, 2, src);
+  if (!shader)
+    return;
+
+  GLuint program = glCreateProgram();
+  glAttachShader(program, shader);
+  glAttachShader(program, gl_state->plane.fragment_shader);
+  glBindAttribLocation(program, ARROW_MESH_ATTRIBUTE, "arrow");
+  glBindFragDataLocation(program, 0, "outColor");
+  glLinkProgram(program);
+
+  GLint link_ok;
+  glGetProgramiv(program, GL_LINK_STATUS, &link_ok);
+  if (!link_ok) {
+    fprintf(stderr, "Failed to link the arrow shader:\n");
+    show_info_log(program, glGetProgramiv, glGetProgramInfoLog);
+    glDeleteProgram(program);
+    glDeleteShader(shader);
+    return;
+  }
+
+  glGenBuffers(1, &gl_state->plane.mesh_vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, gl_state->plane.mesh_vbo);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(arrow_mesh), arrow_mesh, GL_STATIC_DRAW);
+
+  /* The mesh advances per vertex and the points per instance */
+  glGenVertexArrays(1, &gl_state->plane.arrow_vao);
+  glBindVertexArray(gl_state->plane.arrow_vao);
+  glEnableVertexAttribArray(ARROW_MESH_ATTRIBUTE);
+  glVertexAttribPointer(ARROW_MESH_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+  glBindBuffer(GL_ARRAY_BUFFER, gl_state->plane.vbo);
+  GLint pos = glGetAttribLocation(program, "pos");
+  glEnableVertexAttribArray(pos);
+  glVertexAttribPointer(pos, 2, GL_FLOAT, GL_FALSE, 4*sizeof(float), 0);
+  glVertexAttribDivisor(pos, 1);
+
+  GLint dir = glGetAttribLocation(program, "dir");
+  glEnableVertexAttribArray(dir);
+  glVertexAttribPointer(dir, 2, GL_FLOAT, GL_FALSE, 4*sizeof(float),
+                        (void*)(2*sizeof(float)));
+  glVertexAttribDivisor(dir, 1);
+
+  /* An instanced field program reads only the mesh */
+  glBindVertexArray(gl_state->plane.field_vao);
+  glBindBuffer(GL_ARRAY_BUFFER, gl_state->plane.mesh_vbo);
+  glEnableVertexAttribArray(ARROW_MESH_ATTRIBUTE);
+  glVertexAttribPointer(ARROW_MESH_ATTRIBUTE, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+  gl_state->plane.arrow_vertex_shader = shader;
+  gl_state->plane.arrow_program = program;
+}
+
 int
 create_plane_gl_resources(pplane_state_t *pplane_state) {
   gl_state_t *gl_state = pplane_state->gl_state;
@@ -181,8 +498,8 @@ create_plane_gl_resources(pplane_state_t *pplane_state) {
   /* Buffer data */
   glGenBuffers(1, &gl_state->plane.vbo);
 
+  /* Sized by resize_grid() */
   glBindBuffer(GL_ARRAY_BUFFER, gl_state->plane.vbo);
-  glBufferData(GL_ARRAY_BUFFER, sizeof(gl_state->plane.points), gl_state->plane.points, GL_STATIC_DRAW);
 
   // Specify layout of point data
   gl_state->plane.attributes.pos =
@@ -201,9 +518,98 @@ create_plane_gl_resources(pplane_state_t *pplane_state) {
   gl_state->plane.uniforms.scale =
     glGetUniformLocation(gl_state->plane.shader_program, "scale_factor");
 
+  /* The field program has no vertex inputs other than the arrow mesh,
+     but a VAO must be bound to draw. */
+  glGenVertexArrays(1, &gl_state->plane.field_vao);
+  gl_state->plane.field_program = 0;
+
+  gl_state->plane.arrow_program = 0;
+  if (gl3wIsSupported(3, 3))
+    create_arrow_gl_resources(gl_state);
+
   return 0;
 }
 
+static bool
+arrows_instanced(pplane_state_t *pplane_state) {
+  return pplane_state->instanced_arrows &&
+    pplane_state->gl_state->plane.arrow_program;
+}
+
+/* Link the field shader of `entry` into a program drawing arrows
+   instanced or not, or return 0 if that is not possible */
+static GLuint
+build_field_program(gl_state_t *gl_state, compiled_entry_t *entry,
+                    bool instanced) {
+  if (!entry->field_shader_ok)
+    return 0;
+
+  const GLchar *src[] = {
+    entry->field_shader_src,
+    instanced ? field_instanced_main : field_points_main,
+    arrow_mesh_shader_src,
+  };
+  GLuint shader = create_shader_parts(GL_VERTEX_SHADER, instanced ? 3 : 2, src);
+  if (!shader)
+    return 0;
+
+  GLuint program = glCreateProgram();
+  glAttachShader(program, shader);
+  glAttachShader(program, gl_state->plane.fragment_shader);
+  if (!instanced)
+    glAttachShader(program, gl_state->plane.geometry_shader);
+  glBindAttribLocation(program, ARROW_MESH_ATTRIBUTE, "arrow");
+  glBindFragDataLocation(program, 0, "outColor");
+  glLinkProgram(program);
+  /* Freed along with the program */
+  glDeleteShader(shader);
+
+  GLint link_ok;
+  glGetProgramiv(program, GL_LINK_STATUS, &link_ok);
+  if (!link_ok) {
+    fprintf(stderr, "Failed to link the field shader:\n");
+    show_info_log(program, glGetProgramiv, glGetProgramInfoLog);
+    glDeleteProgram(program);
+    return 0;
+  }
+  return program;
+}
+
+/* Use the program that evaluates the field of the current equations on
+   the GPU, linking it unless the compile cache already has it. Leaves
+   `field_program` 0, so that the field is evaluated on the CPU, if
+   that is not possible. */
+static void
+create_field_program(pplane_state_t *pplane_state) {
+  gl_state_t *gl_state = pplane_state->gl_state;
+  compiled_entry_t *entry = pplane_state->compiled;
+  bool instanced = arrows_instanced(pplane_state);
+
+  if (!entry->field_program_built || entry->field_instanced != instanced) {
+    if (entry->field_program)
+      glDeleteProgram(entry->field_program);
+    entry->field_program = build_field_program(gl_state, entry, instanced);
+    entry->field_instanced = instanced;
+    entry->field_program_built = true;
+  }
+
+  GLuint program = entry->field_program;
+  gl_state->plane.field_program = program;
+  if (!program)
+    return;
+
+  gl_state->plane.field_uniforms.grid_size =
+    glGetUniformLocation(program, "grid_size");
+  gl_state->plane.field_uniforms.bounds_min =
+    glGetUniformLocation(program, "bounds_min");
+  gl_state->plane.field_uniforms.bounds_max =
+    glGetUniformLocation(program, "bounds_max");
+  gl_state->plane.field_uniforms.cursor =
+    glGetUniformLocation(program, "cursor");
+  gl_state->plane.field_uniforms.params =
+    glGetUniformLocation(program, "params");
+}
+
 int
 create_gl_resources(pplane_state_t *pplane_state) {
   /* Plane */
@@ -247,24 +653,134 @@ canonical_to_real_coords(pplane_state_t *pplane_state, float x, float y) {
   return result;
 }
 
+/* One arrow per point, from the bound program and VAO */
 static void
-render(pplane_state_t *pplane_state) {
+draw_arrows(pplane_state_t *pplane_state) {
+  if (arrows_instanced(pplane_state))
+    glDrawArraysInstanced(GL_LINE_STRIP, 0, ARROW_MESH_LENGTH,
+                          pplane_state->num_points);
+  else
+    glDrawArrays(GL_POINTS, 0, pplane_state->num_points);
+}
+
+static void
+render_field(pplane_state_t *pplane_state) {
   gl_state_t *gl_state = pplane_state->gl_state;
-  glUseProgram(gl_state->plane.shader_program);
-  glBindVertexArray(gl_state->plane.vao);
-  glBindBuffer(GL_ARRAY_BUFFER, gl_state->plane.vbo);
 
-  /* TODO: Can I update just the data at points[num_points-1] ? */
-  glBufferSubData(GL_ARRAY_BUFFER, 0,
-                  pplane_state->points_size, gl_state->plane.points);
-  glDrawArrays(GL_POINTS, 0, pplane_state->num_points);
+  if (gl_state->plane.field_program) {
+    vec2 cursor = canonical_mouse_pos();
+    glUseProgram(gl_state->plane.field_program);
+    glBindVertexArray(gl_state->plane.field_vao);
+    glUniform2i(gl_state->plane.field_uniforms.grid_size,
+                pplane_state->num_rows, pplane_state->num_columns);
+    glUniform2f(gl_state->plane.field_uniforms.bounds_min,
+                pplane_state->minX, pplane_state->minY);
+    glUniform2f(gl_state->plane.field_uniforms.bounds_max,
+                pplane_state->maxX, pplane_state->maxY);
+    glUniform2f(gl_state->plane.field_uniforms.cursor, cursor.x, cursor.y);
+    glUniform1fv(gl_state->plane.field_uniforms.params, MAX_PARAMS,
+                 pplane_state->params.values);
+    draw_arrows(pplane_state);
+    return;
+  }
+
+  if (arrows_instanced(pplane_state)) {
+    glUseProgram(gl_state->plane.arrow_program);
+    glBindVertexArray(gl_state->plane.arrow_vao);
+  } else {
+    glUseProgram(gl_state->plane.shader_program);
+    glBindVertexArray(gl_state->plane.vao);
+  }
+  draw_arrows(pplane_state);
+}
+
+/* Vertices [first, first+count) need uploading before they are drawn */
+static void
+solution_vertices_changed(gl_state_t *gl_state, int first, int count) {
+  if (count <= 0)
+    return;
+  if (gl_state->solutions.num_uploads == gl_state->solutions.upload_capacity) {
+    int capacity = 2 * gl_state->solutions.upload_capacity + 16;
+    gl_state->solutions.uploads = realloc(gl_state->solutions.uploads,
+                                          sizeof(int[2]) * capacity);
+    gl_state->solutions.upload_capacity = capacity;
+  }
+  int *upload = gl_state->solutions.uploads[gl_state->solutions.num_uploads++];
+  upload[0] = first;
+  upload[1] = count;
+}
+
+/* Blocks are at the same place in the buffer as in the arena, which
+   it grows geometrically to keep up with, uploading everything drawn
+   again when it does. Otherwise only what has changed is uploaded.
+   The arena may be growing on the solver thread, so only the
+   installed blocks are counted. */
+static void
+upload_solutions(gl_state_t *gl_state) {
+  vertex_arena_t *vertices = &gl_state->solutions.vertices;
+  int extent = gl_state->solutions.extent;
+  if (extent > gl_state->solutions.vbo_capacity) {
+    int capacity = 2 * gl_state->solutions.vbo_capacity;
+    if (capacity < extent)
+      capacity = extent;
+    glBufferData(GL_ARRAY_BUFFER, sizeof(float[2]) * capacity, NULL,
+                 GL_DYNAMIC_DRAW);
+    gl_state->solutions.vbo_capacity = capacity;
+
+    gl_state->solutions.num_uploads = 0;
+    for (int i = 0; i < gl_state->solutions.num_solutions; i++) {
+      const solution_t *solution = &gl_state->solutions.solutions[i];
+      for (int half = 0; half < 2; half++)
+        solution_vertices_changed(gl_state, solution->first[half],
+                                  solution->count[half]);
+    }
+  }
+
+  for (int i = 0; i < gl_state->solutions.num_uploads; i++) {
+    const int *upload = gl_state->solutions.uploads[i];
+    glBufferSubData(GL_ARRAY_BUFFER, sizeof(float[2]) * upload[0],
+                    sizeof(float[2]) * upload[1],
+                    arena_vertices(vertices, upload[0]));
+  }
+  gl_state->solutions.num_uploads = 0;
+}
+
+static void
+build_solution_draws(gl_state_t *gl_state) {
+  int needed = 2 * gl_state->solutions.num_solutions;
+  if (needed > gl_state->solutions.draw_capacity) {
+    gl_state->solutions.draw_first = realloc(gl_state->solutions.draw_first,
+                                             sizeof(GLint) * needed);
+    gl_state->solutions.draw_count = realloc(gl_state->solutions.draw_count,
+                                             sizeof(GLsizei) * needed);
+    gl_state->solutions.draw_capacity = needed;
+  }
+
+  int n = 0;
+  for (int i = 0; i < gl_state->solutions.num_solutions; i++) {
+    const solution_t *solution = &gl_state->solutions.solutions[i];
+    for (int half = 0; half < 2; half++) {
+      if (!solution->count[half])
+        continue;
+      gl_state->solutions.draw_first[n] = solution->first[half];
+      gl_state->solutions.draw_count[n] = solution->count[half];
+      n++;
+    }
+  }
+  gl_state->solutions.num_draws = n;
+  gl_state->solutions.draws_changed = false;
+}
+
+static void
+render(pplane_state_t *pplane_state) {
+  gl_state_t *gl_state = pplane_state->gl_state;
+  render_field(pplane_state);
 
   /* Axes */
   glUseProgram(gl_state->axes.shader_program);
   glBindVertexArray(gl_state->axes.vao);
-  glBindBuffer(GL_ARRAY_BUFFER, gl_state->axes.vbo);
-  glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(gl_state->axes.endpoints), gl_state->axes.endpoints);
   glUniform2f(gl_state->axes.uniforms.scale, 1.0, 1.0);
+  glUniform2f(gl_state->axes.uniforms.translate, 0.0, 0.0);
 
   glDrawArrays(GL_LINE_STRIP, 0, 6);
 
@@ -273,12 +789,17 @@ render(pplane_state_t *pplane_state) {
   glBindVertexArray(gl_state->solutions.vao);
 
   glBindBuffer(GL_ARRAY_BUFFER, gl_state->solutions.vbo);
-
-  for (int i = 0; i < gl_state->solutions.num_solutions; i++) {
-    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(gl_state->solutions.solutions[i]), gl_state->solutions.solutions[i]);
-    glUniform2f(gl_state->solutions.uniforms.scale, 1.0, 1.0);
-    glDrawArrays(GL_LINE_STRIP, 0, 2*HALF_NUM_STEPS_PER_SOLUTION);
-  }
+  glUniform2f(gl_state->solutions.uniforms.scale,
+              pplane_state->scaleX, pplane_state->scaleY);
+  glUniform2f(gl_state->solutions.uniforms.translate,
+              pplane_state->translateX, pplane_state->translateY);
+
+  upload_solutions(gl_state);
+  if (gl_state->solutions.draws_changed)
+    build_solution_draws(gl_state);
+  glMultiDrawArrays(GL_LINE_STRIP, gl_state->solutions.draw_first,
+                    gl_state->solutions.draw_count,
+                    gl_state->solutions.num_draws);
 
   nk_sdl_render(NK_ANTI_ALIASING_ON, MAX_VERTEX_MEMORY, MAX_ELEMENT_MEMORY);
 }
@@ -295,36 +816,122 @@ recompute_scale_and_translate(pplane_state_t *pplane_state) {
 
 }
 
+/* Size the points, their buffer and the scratch arrays exactly for a
+   grid of `num_rows` by `num_columns` arrows. Returns false, keeping
+   the current grid, if there is not enough memory. */
+static bool
+resize_grid(pplane_state_t *pplane_state, int num_rows, int num_columns) {
+  gl_state_t *gl_state = pplane_state->gl_state;
+  /* NOTE: last point is for the cursor */
+  int num_points = num_rows*num_columns + 1;
+  size_t grid_size = sizeof(float) * grid_padded_size(num_rows*num_columns);
+
+  point_vertex *points = malloc(sizeof(point_vertex) * num_points);
+  float *scratch[4];
+  bool ok = points != NULL;
+  for (int i = 0; i < 4; i++) {
+    scratch[i] = malloc(grid_size);
+    ok = ok && scratch[i];
+  }
+  if (!ok) {
+    free(points);
+    for (int i = 0; i < 4; i++)
+      free(scratch[i]);
+    return false;
+  }
+
+  free(gl_state->plane.points);
+  free(gl_state->plane.grid_x);
+  free(gl_state->plane.grid_y);
+  free(gl_state->plane.dir_x);
+  free(gl_state->plane.dir_y);
+  gl_state->plane.points = points;
+  gl_state->plane.grid_x = scratch[0];
+  gl_state->plane.grid_y = scratch[1];
+  gl_state->plane.dir_x = scratch[2];
+  gl_state->plane.dir_y = scratch[3];
+
+  pplane_state->num_rows = num_rows;
+  pplane_state->num_columns = num_columns;
+  pplane_state->num_points = num_points;
+  pplane_state->points_size = sizeof(point_vertex) * num_points;
+
+  /* Filled in by the next update_plane() */
+  glBindBuffer(GL_ARRAY_BUFFER, gl_state->plane.vbo);
+  glBufferData(GL_ARRAY_BUFFER, pplane_state->points_size, NULL,
+               GL_DYNAMIC_DRAW);
+  pplane_state->dirty |= DIRTY_GRID;
+  return true;
+}
+
 static void
 fill_plane_data(pplane_state_t *pplane_state) {
   vec2 min = canonical_to_real_coords(pplane_state, -1.0, -1.0);
   vec2 max = canonical_to_real_coords(pplane_state, 1.0, 1.0);
 
+  int num_rows = pplane_state->num_rows;
+  int num_columns = pplane_state->num_columns;
   float stepX = (max.x - min.x) / num_rows;
   float stepY = (max.y - min.y) / num_columns;
 
-  point_vertex *points = pplane_state->gl_state->plane.points;
+  gl_state_t *gl_state = pplane_state->gl_state;
+  float *grid_x = gl_state->plane.grid_x;
+  float *grid_y = gl_state->plane.grid_y;
+  float *dir_x = gl_state->plane.dir_x;
+  float *dir_y = gl_state->plane.dir_y;
 
-  int index = 0;
-  for (float i = min.x;
-       i < max.x;
-       i += stepX) {
-    for (float j = min.y;
-         j < max.y;
-         j += stepY) {
-      vec2 v = {.x = i, .y = j };
-      vec2 arrow = unit_vector(diffeq_system(pplane_state, v));
-      vec2 canon_coords = real_to_canonical_coords(pplane_state, i, j);
-
-      points[index].x = canon_coords.x;
-      points[index].y = canon_coords.y;
-
-      points[index].dirX = arrow.x * 0.05;
-      points[index].dirY = arrow.y * 0.05;
+  int num_grid_points = num_rows*num_columns;
+  int num_padded = grid_padded_size(num_grid_points);
 
+  int index = 0;
+  for (int i = 0; i < num_rows; i++) {
+    for (int j = 0; j < num_columns; j++) {
+      grid_x[index] = min.x + i*stepX;
+      grid_y[index] = min.y + j*stepY;
       index += 1;
     }
   }
+  /* The passes below transform the padding in place too, so it is
+     reset each time to a point of the grid */
+  for (; index < num_padded; index++) {
+    grid_x[index] = min.x;
+    grid_y[index] = min.y;
+  }
+
+  eval_context_t ctx;
+  eval_context_init(&ctx, pplane_state, pplane_state->use_jit);
+  float *derivs[2] = { dir_x, dir_y };
+  diffeq_system_batch(&ctx, num_padded, grid_x, grid_y, derivs);
+
+  /* Normalise the arrows and move the grid to canonical coordinates,
+     a full set of lanes at a time. */
+  lanef arrow_length = lanef_set1(0.05f);
+  lanef scale_x = lanef_set1(pplane_state->scaleX);
+  lanef scale_y = lanef_set1(pplane_state->scaleY);
+  lanef translate_x = lanef_set1(pplane_state->translateX);
+  lanef translate_y = lanef_set1(pplane_state->translateY);
+
+  for (int i = 0; i < num_padded; i += LANE_WIDTH) {
+    lanef dx = lanef_load(dir_x + i);
+    lanef dy = lanef_load(dir_y + i);
+    lanef m = lanef_sqrt(lanef_add(lanef_mul(dx, dx), lanef_mul(dy, dy)));
+    lanef k = lanef_div(arrow_length, m);
+    lanef_store(dir_x + i, lanef_mul(dx, k));
+    lanef_store(dir_y + i, lanef_mul(dy, k));
+
+    lanef x = lanef_load(grid_x + i);
+    lanef y = lanef_load(grid_y + i);
+    lanef_store(grid_x + i, lanef_sub(lanef_mul(x, scale_x), translate_x));
+    lanef_store(grid_y + i, lanef_sub(lanef_mul(y, scale_y), translate_y));
+  }
+
+  point_vertex *points = gl_state->plane.points;
+  for (int i = 0; i < num_grid_points; i++) {
+    points[i].x = grid_x[i];
+    points[i].y = grid_y[i];
+    points[i].dirX = dir_x[i];
+    points[i].dirY = dir_y[i];
+  }
 }
 
 static void
@@ -364,7 +971,9 @@ set_mouse_position(pplane_state_t *pplane_state) {
   vec2 m = canonical_mouse_pos();
   vec2 real_m = canonical_to_real_coords(pplane_state,
                                          m.x, m.y);
-  vec2 arrow = unit_vector(diffeq_system(pplane_state, real_m));
+  eval_context_t ctx;
+  eval_context_init(&ctx, pplane_state, pplane_state->use_jit);
+  vec2 arrow = unit_vector(diffeq_system(&ctx, real_m));
   point_vertex *points = pplane_state->gl_state->plane.points;
 
   points[pplane_state->num_points-1].x = m.x;
@@ -373,46 +982,624 @@ set_mouse_position(pplane_state_t *pplane_state) {
   points[pplane_state->num_points-1].dirY = arrow.y;
 }
 
+/* Bring the scale, axes, field and cursor arrow up to date with their
+   inputs, redoing and uploading only what those changes affect. A
+   moving cursor redoes just its own arrow, the last point. */
+static void
+update_plane(pplane_state_t *pplane_state) {
+  gl_state_t *gl_state = pplane_state->gl_state;
+  vec2 cursor = canonical_mouse_pos();
+  if (cursor.x != pplane_state->cursor[0] ||
+      cursor.y != pplane_state->cursor[1]) {
+    pplane_state->cursor[0] = cursor.x;
+    pplane_state->cursor[1] = cursor.y;
+    pplane_state->dirty |= DIRTY_CURSOR;
+  }
+
+  unsigned dirty = pplane_state->dirty;
+  pplane_state->dirty = 0;
+
+  if (dirty & DIRTY_BOUNDS) {
+    recompute_scale_and_translate(pplane_state);
+    fill_axes_data(pplane_state);
+    glBindBuffer(GL_ARRAY_BUFFER, gl_state->axes.vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(gl_state->axes.endpoints),
+                    gl_state->axes.endpoints);
+  }
+
+  /* The field program reads everything else as uniforms */
+  if (gl_state->plane.field_program)
+    return;
+
+  int cursor_index = pplane_state->num_points - 1;
+  point_vertex *points = gl_state->plane.points;
+  glBindBuffer(GL_ARRAY_BUFFER, gl_state->plane.vbo);
+  if (dirty & (DIRTY_BOUNDS | DIRTY_SYSTEM | DIRTY_PARAMS | DIRTY_GRID)) {
+    fill_plane_data(pplane_state);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(point_vertex) * cursor_index,
+                    points);
+  }
+  if (dirty) {
+    set_mouse_position(pplane_state);
+    glBufferSubData(GL_ARRAY_BUFFER, sizeof(point_vertex) * cursor_index,
+                    sizeof(point_vertex), &points[cursor_index]);
+  }
+}
+
+/* Mark every trajectory out of date */
+static void
+invalidate_solutions(gl_state_t *gl_state) {
+  gl_state->solutions.generation++;
+  gl_state->solutions.recompute_solutions = true;
+}
+
+/* Whether `solution` was cut short by a box the view extends past */
+static bool
+solution_clipped_by_view(pplane_state_t *pplane_state,
+                         const solution_t *solution) {
+  const float *box = solution->box;
+  bool clipped = solution->clipped[0] || solution->clipped[1];
+  bool covered = pplane_state->minX >= box[0] &&
+                 pplane_state->minY >= box[1] &&
+                 pplane_state->maxX <= box[2] &&
+                 pplane_state->maxY <= box[3];
+  return clipped && !covered;
+}
+
+/* Mark one trajectory out of date, discarding any results for it
+   still to come from the job in flight */
+static void
+invalidate_solution(gl_state_t *gl_state, solution_t *solution) {
+  solution->solved = gl_state->solutions.generation - 1;
+  solution->version++;
+  gl_state->solutions.recompute_solutions = true;
+}
+
+/* The view has moved. Trajectories are kept in real coordinates, so
+   only those that were cut short by a box the view now extends past
+   need integrating again. Those still being solved are checked when
+   they are installed. */
+static void
+invalidate_clipped_solutions(pplane_state_t *pplane_state) {
+  gl_state_t *gl_state = pplane_state->gl_state;
+  for (int c = 0; c < gl_state->solutions.num_solutions; c++) {
+    solution_t *solution = &gl_state->solutions.solutions[c];
+    if (solution_clipped_by_view(pplane_state, solution))
+      invalidate_solution(gl_state, solution);
+  }
+}
+
 static void
 handle_event(pplane_state_t *pplane_state, SDL_Event *event) {
   gl_state_t *gl_state = pplane_state->gl_state;
   /* TODO: ignore mouse clicks on Nuklear GUI */
   if (event->type == SDL_MOUSEBUTTONDOWN) {
-    int solutions_idx = gl_state->solutions.num_solutions;
+    if (gl_state->solutions.num_solutions == gl_state->solutions.capacity) {
+      int capacity = 2 * gl_state->solutions.capacity + 16;
+      solution_t *solutions = realloc(gl_state->solutions.solutions,
+                                      sizeof(solution_t) * capacity);
+      if (!solutions)
+        return;
+      gl_state->solutions.solutions = solutions;
+      gl_state->solutions.capacity = capacity;
+    }
+    solution_t *solution =
+      &gl_state->solutions.solutions[gl_state->solutions.num_solutions];
 
     vec2 canon_init = canonical_mouse_pos();
     vec2 real_init = canonical_to_real_coords(pplane_state,
                                               canon_init.x,
                                               canon_init.y);
-    gl_state->solutions.init[solutions_idx][0] = real_init.x;
-    gl_state->solutions.init[solutions_idx][1] = real_init.y;
-
+    solution->init[0] = real_init.x;
+    solution->init[1] = real_init.y;
+    solution->count[0] = solution->count[1] = 0;
+    solution->solved = gl_state->solutions.generation - 1;
+    solution->version = 0;
+    /* Not clipped, by an empty box, until it is solved */
+    solution->clipped[0] = solution->clipped[1] = false;
+    solution->box[0] = solution->box[1] = INFINITY;
+    solution->box[2] = solution->box[3] = -INFINITY;
+
+    /* Only the new trajectory needs integrating */
     gl_state->solutions.num_solutions += 1;
     gl_state->solutions.recompute_solutions = true;
   }
 }
 
+/* Most halves of trajectories integrated together by one RK4 task */
+#define MAX_SOLVE_BATCH 64
+
+/* Samples in a whole half of a trajectory */
+#define SOLVE_HALF_LENGTH (HALF_NUM_STEPS_PER_SOLUTION + 1)
+
+/* A solve job's work on one solution. Each half is integrated into a
+   block big enough for all of it, which becomes the solution's as
+   soon as some of it is shown. */
+typedef struct {
+  int solution;
+  unsigned version;
+
+  int block[2];                 /* -1 if there was no memory */
+  trajectory_t halves[2];       /* backward and forward */
+
+  /* What the main thread may draw, as of the last round */
+  int published[2];
+  bool finished[2];
+
+  /* Main thread only: whether each half's block belongs to the
+     solution yet, and whether it is there for good */
+  bool installed[2], final[2];
+} solve_result_t;
+
+/* A recompute of the out of date trajectories, run by the solver
+   thread. It has its own copy of everything it reads, so the UI can
+   carry on changing the originals.
+
+   Integration goes in rounds, each taking every unfinished half up to
+   `until` samples: one task for the thread pool per half, or with RK4
+   per batch of halves in the same direction. Rounds are sized to take
+   about `budget` seconds, and what each produced is published at its
+   end, so trajectories grow out from their initial conditions while
+   the main thread draws them. */
+struct solve_job {
+  compiled_entry_t *compiled;   /* pinned until the job is retired */
+  float params[MAX_PARAMS];
+  integrator_t integrator;
+  stop_criteria_t stop;
+  unsigned generation;
+  double budget;
+  vertex_arena_t *vertices;
+  thread_pool_t *pool;
+  eval_context_t contexts[MAX_WORKERS];
+
+  solve_result_t *results;
+  int num_results;
+  int batch_size, num_batches;  /* num_batches is per direction */
+  int until;
+
+  /* Set to skip the tasks not yet started, and stop after the round */
+  SDL_atomic_t cancelled;
+
+  /* Guards the published results and `rounds`, which counts the
+     rounds published; the main thread has taken `installed_rounds`. */
+  SDL_mutex *mutex;
+  SDL_cond *done;
+  int rounds, installed_rounds;
+  bool finished;
+};
+
+static void
+solve_task(void *data, int index, int worker) {
+  solve_job_t *job = data;
+  bool backward = index % 2 == 0;
+  trajectory_t *trajectory = &job->results[index / 2].halves[!backward];
+  if (SDL_AtomicGet(&job->cancelled) || trajectory->done)
+    return;
+
+  integrate(&job->contexts[worker], job->integrator, trajectory,
+            backward ? -SOLUTION_DT : SOLUTION_DT, job->until, &job->stop);
+}
+
+static void
+solve_batch_task(void *data, int index, int worker) {
+  solve_job_t *job = data;
+  if (SDL_AtomicGet(&job->cancelled))
+    return;
+  bool backward = index < job->num_batches;
+  int first = (index % job->num_batches) * job->batch_size;
+  int n = job->num_results - first;
+  if (n > job->batch_size)
+    n = job->batch_size;
+
+  trajectory_t *trajectories[MAX_SOLVE_BATCH];
+  for (int c = 0; c < n; c++)
+    trajectories[c] = &job->results[first + c].halves[!backward];
+  integrate_batch(&job->contexts[worker], n, trajectories,
+                  backward ? -SOLUTION_DT : SOLUTION_DT, job->until,
+                  &job->stop);
+}
+
+/* Wake the main loop to show a job's progress */
+static void
+solver_thread_notify(solver_thread_t *solver) {
+  if (solver->event == (Uint32)-1 || SDL_AtomicSet(&solver->woken, 1))
+    return;
+
+  SDL_Event event;
+  SDL_zero(event);
+  event.type = solver->event;
+  if (SDL_PushEvent(&event) <= 0)
+    SDL_AtomicSet(&solver->woken, 0);
+}
+
+static void
+solve_job_run(solver_thread_t *solver, solve_job_t *job) {
+  /* A batch per worker in each direction, so that a few trajectories
+     still use the whole pool, but none smaller than a lane */
+  int workers = job->pool->num_threads + 1;
+  int batch_size = (job->num_results + workers - 1) / workers;
+  if (batch_size < LANE_WIDTH)
+    batch_size = LANE_WIDTH;
+  if (batch_size > MAX_SOLVE_BATCH)
+    batch_size = MAX_SOLVE_BATCH;
+  job->batch_size = batch_size;
+  job->num_batches = (job->num_results + batch_size - 1) / batch_size;
+  int slice = 16;
+  job->until = 1;
+
+  while (job->until < SOLVE_HALF_LENGTH && !SDL_AtomicGet(&job->cancelled)) {
+    job->until += slice;
+    if (job->until > SOLVE_HALF_LENGTH)
+      job->until = SOLVE_HALF_LENGTH;
+
+    Uint64 start = SDL_GetPerformanceCounter();
+    if (job->integrator != INTEGRATOR_RK4)
+      thread_pool_run(job->pool, 2 * job->num_results, solve_task, job);
+    else
+      thread_pool_run(job->pool, 2 * job->num_batches, solve_batch_task, job);
+    double elapsed = (double)(SDL_GetPerformanceCounter() - start) /
+      SDL_GetPerformanceFrequency();
+
+    SDL_LockMutex(job->mutex);
+    for (int i = 0; i < job->num_results; i++) {
+      solve_result_t *result = &job->results[i];
+      for (int half = 0; half < 2; half++) {
+        const trajectory_t *trajectory = &result->halves[half];
+        result->published[half] = trajectory->length;
+        result->finished[half] = trajectory->done ||
+                                 trajectory->length == SOLVE_HALF_LENGTH;
+      }
+    }
+    job->rounds++;
+    SDL_UnlockMutex(job->mutex);
+    solver_thread_notify(solver);
+
+    /* Size the next round to the budget */
+    double scale = elapsed > 0 ? job->budget / elapsed : 2;
+    slice = fmin(fmax(slice * fmin(scale, 2), 1), SOLVE_HALF_LENGTH);
+  }
+
+  SDL_LockMutex(job->mutex);
+  job->finished = true;
+  SDL_CondSignal(job->done);
+  SDL_UnlockMutex(job->mutex);
+  solver_thread_notify(solver);
+}
+
+static int
+solver_thread_main(void *data) {
+  solver_thread_t *solver = data;
+  SDL_LockMutex(solver->mutex);
+  for (;;) {
+    while (!solver->pending && !solver->quit)
+      SDL_CondWait(solver->wake, solver->mutex);
+    if (solver->quit)
+      break;
+    solve_job_t *job = solver->pending;
+    solver->pending = NULL;
+
+    SDL_UnlockMutex(solver->mutex);
+    solve_job_run(solver, job);
+    SDL_LockMutex(solver->mutex);
+  }
+  SDL_UnlockMutex(solver->mutex);
+  return 0;
+}
+
+static void
+solver_thread_init(solver_thread_t *solver) {
+  solver->mutex = SDL_CreateMutex();
+  solver->wake = SDL_CreateCond();
+  solver->pending = NULL;
+  solver->quit = false;
+  solver->event = SDL_RegisterEvents(1);
+  SDL_AtomicSet(&solver->woken, 0);
+  solver->thread = SDL_CreateThread(solver_thread_main, "solver", solver);
+}
+
+static void
+solver_thread_destroy(solver_thread_t *solver) {
+  SDL_LockMutex(solver->mutex);
+  solver->quit = true;
+  SDL_CondSignal(solver->wake);
+  SDL_UnlockMutex(solver->mutex);
+  SDL_WaitThread(solver->thread, NULL);
+  SDL_DestroyCond(solver->wake);
+  SDL_DestroyMutex(solver->mutex);
+}
+
+/* Snapshot the out of date trajectories into a job for the solver
+   thread. Returns NULL if there are none, or no memory for the job;
+   they are left out of date until the next recompute. */
+static solve_job_t *
+solve_job_create(pplane_state_t *pplane_state) {
+  gl_state_t *gl_state = pplane_state->gl_state;
+  int num_stale = 0;
+  for (int c = 0; c < gl_state->solutions.num_solutions; c++)
+    if (gl_state->solutions.solutions[c].solved != gl_state->solutions.generation)
+      num_stale++;
+  if (num_stale == 0)
+    return NULL;
+
+  solve_job_t *job = malloc(sizeof(solve_job_t));
+  solve_result_t *results = malloc(sizeof(solve_result_t) * num_stale);
+  if (!job || !results) {
+    free(job);
+    free(results);
+    return NULL;
+  }
+  job->vertices = &gl_state->solutions.vertices;
+  job->results = results;
+  job->num_results = 0;
+  for (int c = 0; c < gl_state->solutions.num_solutions; c++) {
+    const solution_t *solution = &gl_state->solutions.solutions[c];
+    if (solution->solved == gl_state->solutions.generation)
+      continue;
+    solve_result_t *result = &job->results[job->num_results++];
+    result->solution = c;
+    result->version = solution->version;
+    vec2 init = { solution->init[0], solution->init[1] };
+
+    for (int half = 0; half < 2; half++) {
+      trajectory_t *trajectory = &result->halves[half];
+      result->block[half] = arena_alloc(job->vertices, SOLVE_HALF_LENGTH);
+      if (result->block[half] >= 0) {
+        trajectory_init(trajectory, init,
+                        (vec2 *)arena_vertices(job->vertices,
+                                               result->block[half]));
+      }
+      else {
+        trajectory->length = 0;
+        trajectory->done = true;
+      }
+      result->published[half] = 0;
+      result->finished[half] = false;
+      result->installed[half] = result->final[half] = false;
+    }
+  }
+
+  job->compiled = pplane_state->compiled;
+  job->compiled->pinned = true;
+  memcpy(job->params, pplane_state->params.values, sizeof(job->params));
+  job->integrator = pplane_state->integrator;
+  job->generation = gl_state->solutions.generation;
+  job->budget = pplane_state->solve_budget_ms / 1000.0;
+  job->pool = &pplane_state->pool;
+  for (int i = 0; i <= pplane_state->pool.num_threads; i++) {
+    eval_context_init(&job->contexts[i], pplane_state, pplane_state->use_jit);
+    job->contexts[i].params = job->params;
+    /* Fast math is for the field only; batched trajectories use libm
+       so they agree with rk4() */
+    job->contexts[i].fast_math = false;
+  }
+
+  /* Trajectories end once they are a whole view away from the one
+     shown, or have all but reached a fixed point. */
+  float width = pplane_state->maxX - pplane_state->minX;
+  float height = pplane_state->maxY - pplane_state->minY;
+  job->stop.min_x = pplane_state->minX - width;
+  job->stop.max_x = pplane_state->maxX + width;
+  job->stop.min_y = pplane_state->minY - height;
+  job->stop.max_y = pplane_state->maxY + height;
+  job->stop.min_speed = 1e-6f * fmaxf(width, height);
+
+  SDL_AtomicSet(&job->cancelled, 0);
+  job->mutex = SDL_CreateMutex();
+  job->done = SDL_CreateCond();
+  job->rounds = job->installed_rounds = 0;
+  job->finished = false;
+  return job;
+}
+
+/* Give half of a solution the samples published for it. A finished
+   half is moved to a block of its own size, freeing the big one. */
+static void
+install_half(gl_state_t *gl_state, solve_job_t *job, solve_result_t *result,
+             int half) {
+  solution_t *solution = &gl_state->solutions.solutions[result->solution];
+  int count = result->published[half];
+  if (result->final[half] || (count == 0 && !result->finished[half]))
+    return;
+
+  if (result->block[half] < 0) {
+    /* There was no memory to integrate it into */
+    if (solution->count[half])
+      arena_free(job->vertices, solution->first[half], solution->size[half]);
+    solution->count[half] = 0;
+    result->final[half] = true;
+    gl_state->solutions.draws_changed = true;
+    return;
+  }
+
+  /* Vertices of the block that have been uploaded already */
+  int uploaded = solution->count[half];
+  if (!result->installed[half]) {
+    if (solution->count[half])
+      arena_free(job->vertices, solution->first[half], solution->size[half]);
+    solution->first[half] = result->block[half];
+    solution->size[half] = SOLVE_HALF_LENGTH;
+    result->installed[half] = true;
+    uploaded = 0;
+  }
+  solution->count[half] = count;
+
+  if (result->finished[half]) {
+    int first = arena_alloc(job->vertices, count);
+    if (first >= 0) {
+      memcpy(arena_vertices(job->vertices, first),
+             arena_vertices(job->vertices, solution->first[half]),
+             sizeof(float[2]) * count);
+      arena_free(job->vertices, solution->first[half], solution->size[half]);
+      solution->first[half] = first;
+      solution->size[half] = count;
+      uploaded = 0;
+    }
+
+    const float *last = arena_vertices(job->vertices,
+                                       solution->first[half])[count - 1];
+    solution->clipped[half] =
+      last[0] < job->stop.min_x || last[0] > job->stop.max_x ||
+      last[1] < job->stop.min_y || last[1] > job->stop.max_y;
+    result->final[half] = true;
+  }
+
+  if (solution->first[half] + count > gl_state->solutions.extent)
+    gl_state->solutions.extent = solution->first[half] + count;
+  solution_vertices_changed(gl_state, solution->first[half] + uploaded,
+                            count - uploaded);
+  gl_state->solutions.draws_changed = true;
+}
+
+/* Show what the job has published since the last call, for solutions
+   that have not been made out of date in the meantime. Returns
+   whether the job has finished. */
+static bool
+solve_job_install(pplane_state_t *pplane_state, solve_job_t *job) {
+  gl_state_t *gl_state = pplane_state->gl_state;
+  SDL_LockMutex(job->mutex);
+  bool finished = job->finished;
+  if (job->rounds == job->installed_rounds ||
+      job->generation != gl_state->solutions.generation) {
+    SDL_UnlockMutex(job->mutex);
+    return finished;
+  }
+  job->installed_rounds = job->rounds;
+
+  for (int i = 0; i < job->num_results; i++) {
+    solve_result_t *result = &job->results[i];
+    solution_t *solution = &gl_state->solutions.solutions[result->solution];
+    if (result->version != solution->version ||
+        (result->final[0] && result->final[1]))
+      continue;
+
+    install_half(gl_state, job, result, 0);
+    install_half(gl_state, job, result, 1);
+    if (result->final[0] && result->final[1]) {
+      solution->solved = job->generation;
+      solution->box[0] = job->stop.min_x;
+      solution->box[1] = job->stop.min_y;
+      solution->box[2] = job->stop.max_x;
+      solution->box[3] = job->stop.max_y;
+      /* The view may have moved past the job's box since it began */
+      if (solution_clipped_by_view(pplane_state, solution))
+        invalidate_solution(gl_state, solution);
+    }
+  }
+  SDL_UnlockMutex(job->mutex);
+  return finished;
+}
+
+/* Free a finished job, along with the blocks it made that were never
+   shown. */
+static void
+solve_job_retire(pplane_state_t *pplane_state, solve_job_t *job) {
+  for (int i = 0; i < job->num_results; i++) {
+    solve_result_t *result = &job->results[i];
+    for (int half = 0; half < 2; half++)
+      if (!result->installed[half] && result->block[half] >= 0)
+        arena_free(job->vertices, result->block[half], SOLVE_HALF_LENGTH);
+  }
+  job->compiled->pinned = false;
+  SDL_DestroyCond(job->done);
+  SDL_DestroyMutex(job->mutex);
+  free(job->results);
+  free(job);
+  pplane_state->job = NULL;
+}
+
+/* Stop the job in flight, if any, and wait for it without installing
+   anything more. */
+static void
+solve_job_abandon(pplane_state_t *pplane_state) {
+  solve_job_t *job = pplane_state->job;
+  if (!job)
+    return;
+
+  SDL_AtomicSet(&job->cancelled, 1);
+  SDL_LockMutex(job->mutex);
+  while (!job->finished)
+    SDL_CondWait(job->done, job->mutex);
+  SDL_UnlockMutex(job->mutex);
+  solve_job_retire(pplane_state, job);
+}
+
+/* Called every frame: take in what the solver thread has finished,
+   and start it on the trajectories that are out of date. A job made
+   out of date by a change is cancelled and replaced once it stops;
+   whatever it completed first is kept where still valid. */
+static void
+update_solutions(pplane_state_t *pplane_state) {
+  gl_state_t *gl_state = pplane_state->gl_state;
+  solve_job_t *job = pplane_state->job;
+  if (job) {
+    if (!solve_job_install(pplane_state, job)) {
+      if (gl_state->solutions.recompute_solutions)
+        SDL_AtomicSet(&job->cancelled, 1);
+      return;
+    }
+    solve_job_retire(pplane_state, job);
+    /* A cancelled job leaves trajectories still to do */
+    gl_state->solutions.recompute_solutions = true;
+  }
+
+  if (!gl_state->solutions.recompute_solutions)
+    return;
+  gl_state->solutions.recompute_solutions = false;
+  pplane_state->job = solve_job_create(pplane_state);
+  if (!pplane_state->job)
+    return;
+
+  solver_thread_t *solver = &pplane_state->solver;
+  SDL_LockMutex(solver->mutex);
+  solver->pending = pplane_state->job;
+  SDL_CondSignal(solver->wake);
+  SDL_UnlockMutex(solver->mutex);
+}
+
 int main(int argc, char *argv[]) {
   gl_state_t gl_state;
   pplane_state_t pplane_state;
   pplane_state.gl_state = &gl_state;
-  snprintf(pplane_state.xeqn, 64, "x*x+y");
-  snprintf(pplane_state.yeqn, 64, "x-y");
-
-  env.x = 2.3;
-  env.y = 1.0;
-  look = pplane_state.xeqn;
-  printf("%f\n", expression());
+  snprintf(pplane_state.xeqn, sizeof(pplane_state.xeqn), "x*x+y");
+  snprintf(pplane_state.yeqn, sizeof(pplane_state.yeqn), "x-y");
+  pplane_state.stop_eqn[0] = 0;
+  pplane_state.compile_cache = calloc(COMPILE_CACHE_SIZE,
+                                      sizeof(compiled_entry_t));
+  pplane_state.compiled = NULL;
+  pplane_state.compile_clock = 0;
+  pplane_state.use_jit = 1;
+  pplane_state.integrator = INTEGRATOR_RK4;
+  pplane_state.fast_math = 1;
+  pplane_state.eqn_error[0] = 0;
+  pplane_state.comparison[0][0] = 0;
+  pplane_state.params.count = 0;
+  pplane_state.field_shader_changed = false;
+  pplane_state.instanced_arrows = 1;
+  pplane_state.dirty = DIRTY_ALL;
+  pplane_state.cursor[0] = pplane_state.cursor[1] = 0;
+  compile_equations(&pplane_state);
 
   SDL_Init(SDL_INIT_EVERYTHING);
+  /* The solver thread works alongside the pool's threads, leaving a
+     core for the UI */
+  thread_pool_init(&pplane_state.pool, SDL_GetCPUCount() - 2);
+  solver_thread_init(&pplane_state.solver);
+  pplane_state.job = NULL;
+  pplane_state.solve_budget_ms = 16;
 
   SDL_GL_SetAttribute(SDL_GL_CONTEXT_PROFILE_MASK, SDL_GL_CONTEXT_PROFILE_CORE);
   SDL_GL_SetAttribute(SDL_GL_CONTEXT_MAJOR_VERSION, 3);
-  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 2);
+  SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 3);
   SDL_GL_SetAttribute(SDL_GL_STENCIL_SIZE, 8);
 
   SDL_Window* window = SDL_CreateWindow("pplane", 100, 100, WIDTH, HEIGHT, SDL_WINDOW_OPENGL);
   SDL_GLContext context = SDL_GL_CreateContext(window);
+  if (!context) {
+    /* 3.3 only adds instanced arrows; draw them with the geometry
+       shader instead */
+    SDL_GL_SetAttribute(SDL_GL_CONTEXT_MINOR_VERSION, 2);
+    context = SDL_GL_CreateContext(window);
+  }
   int win_width, win_height;
   SDL_GetWindowSize(window, &win_width, &win_height);
 
@@ -422,7 +1609,18 @@ int main(int argc, char *argv[]) {
   }
 
   gl_state.solutions.num_solutions = 0;
-
+  gl_state.solutions.capacity = 0;
+  gl_state.solutions.solutions = NULL;
+  gl_state.solutions.extent = 0;
+  arena_init(&gl_state.solutions.vertices);
+  gl_state.solutions.uploads = NULL;
+  gl_state.solutions.num_uploads = gl_state.solutions.upload_capacity = 0;
+  gl_state.solutions.draw_first = NULL;
+  gl_state.solutions.draw_count = NULL;
+  gl_state.solutions.num_draws = gl_state.solutions.draw_capacity = 0;
+  gl_state.solutions.draws_changed = false;
+  gl_state.solutions.generation = 0;
+  gl_state.solutions.recompute_solutions = false;
 
   /* GUI */
   struct nk_context *ctx;
@@ -436,53 +1634,71 @@ int main(int argc, char *argv[]) {
 
   struct nk_color background = nk_rgb(28,48,62);
 
-  /* NOTE: last point is for the cursor */
-  pplane_state.num_points = num_rows*num_columns + 1;
-  pplane_state.points_size = sizeof(point_vertex) *
-    pplane_state.num_points;
-
-  /* FIXME: when the bounds of the plane are changed,
-     `fill_plane_data` tries to fill in more points than
-     num_rows*num_columns. To account for that, I've allocated extra
-     storage. However, the real fix is to get rid of the extra
-     points. */
-  gl_state.plane.points = malloc(2*pplane_state.points_size);
-
   /* Shaders and GLSL program */
   create_gl_resources(&pplane_state);
   glUseProgram(gl_state.plane.shader_program);
   glBindVertexArray(gl_state.plane.vao);
-  glBindBuffer(GL_ARRAY_BUFFER, gl_state.plane.vbo);
 
   glUniform2f(gl_state.plane.uniforms.scale, 1.0, 1.0);
 
+  gl_state.plane.points = NULL;
+  gl_state.plane.grid_x = gl_state.plane.grid_y = NULL;
+  gl_state.plane.dir_x = gl_state.plane.dir_y = NULL;
+  if (!resize_grid(&pplane_state, 20, 20)) {
+    fprintf(stderr, "Not enough memory for the direction field\n");
+    return 1;
+  }
+
   pplane_state.minX = -5.0;
   pplane_state.minY = -20.0;
   pplane_state.maxX = 20.0;
   pplane_state.maxY = 10.0;
 
-  recompute_scale_and_translate(&pplane_state);
-  fill_plane_data(&pplane_state);
-
-  glBufferData(GL_ARRAY_BUFFER, pplane_state.points_size,
-               gl_state.plane.points, GL_STATIC_DRAW);
+  /* Draw the first frame without waiting for input */
+  bool frame_due = true;
+  bool running = true;
+  while (running) {
+    /* Sleep until there is input or the solver has something new to
+       show. The timeout only matters if a wake-up is lost. */
+    SDL_Event window_event;
+    bool have_event;
+    if (frame_due)
+      have_event = SDL_PollEvent(&window_event);
+    else {
+      have_event = SDL_WaitEventTimeout(&window_event, WAKE_TIMEOUT_MS);
+      if (!have_event && !pplane_state.job)
+        continue;
+    }
 
-  SDL_Event window_event;
-  while (true) {
+    /* Take every pending event, rather than one a frame */
+    bool input = false;
     nk_input_begin(ctx);
-    if (SDL_PollEvent(&window_event)) {
-      if (window_event.type == SDL_QUIT) break;
-      nk_sdl_handle_event(&window_event);
+    for (; have_event; have_event = SDL_PollEvent(&window_event)) {
+      if (window_event.type == SDL_QUIT) {
+        running = false;
+        break;
+      }
+      if (window_event.type == pplane_state.solver.event) {
+        SDL_AtomicSet(&pplane_state.solver.woken, 0);
+        continue;
+      }
 
+      input = true;
+      nk_sdl_handle_event(&window_event);
       if (nk_item_is_any_active(ctx) == 0)
         handle_event(&pplane_state, &window_event);
     }
     nk_input_end(ctx);
+    if (!running)
+      break;
+
+    /* Nuklear shows some changes a frame after the input behind them */
+    frame_due = input;
 
     /* GUI */
     {
       struct nk_panel layout;
-      if (nk_begin(ctx, &layout, "pplane", nk_rect(200, 200, 210, 350),
+      if (nk_begin(ctx, &layout, "pplane", nk_rect(200, 200, 210, 410),
                    NK_WINDOW_BORDER|NK_WINDOW_MOVABLE|NK_WINDOW_SCALABLE|
                    NK_WINDOW_MINIMIZABLE|NK_WINDOW_TITLE)) {
         static float minX = -5.0;
@@ -503,18 +1719,53 @@ int main(int argc, char *argv[]) {
         nk_property_float(ctx, "y_max:", -100, &maxY, 100, 10, 1);
 
         if (nk_button_label(ctx, "Apply changes")) {
-          gl_state.solutions.recompute_solutions = true;
           pplane_state.minX = minX;
           pplane_state.maxX = maxX;
 
           pplane_state.minY = minY;
           pplane_state.maxY = maxY;
+          pplane_state.dirty |= DIRTY_BOUNDS;
+          invalidate_clipped_solutions(&pplane_state);
         }
 
         if (nk_button_label(ctx, "Clear solutions")) {
+          solve_job_abandon(&pplane_state);
           gl_state.solutions.num_solutions = 0;
+          gl_state.solutions.extent = 0;
+          gl_state.solutions.num_uploads = 0;
+          gl_state.solutions.draws_changed = true;
+          arena_clear(&gl_state.solutions.vertices);
         }
 
+        static const char *integrators[NUM_INTEGRATORS] = {
+          "RK4", "Dormand-Prince", "Rosenbrock", "Automatic"
+        };
+        nk_layout_row_dynamic(ctx, 25, 1);
+        integrator_t integrator = nk_combo(ctx, integrators, NUM_INTEGRATORS,
+                                           pplane_state.integrator, 25);
+        if (integrator != pplane_state.integrator) {
+          pplane_state.integrator = integrator;
+          invalidate_solutions(&gl_state);
+        }
+
+        /* Arrows in each direction */
+        int num_rows = pplane_state.num_rows;
+        int num_columns = pplane_state.num_columns;
+        nk_layout_row_dynamic(ctx, 25, 1);
+        nk_property_int(ctx, "Rows:", MIN_GRID_SIZE, &num_rows, MAX_GRID_SIZE,
+                        10, 1);
+        nk_layout_row_dynamic(ctx, 25, 1);
+        nk_property_int(ctx, "Columns:", MIN_GRID_SIZE, &num_columns,
+                        MAX_GRID_SIZE, 10, 1);
+        if (num_rows != pplane_state.num_rows ||
+            num_columns != pplane_state.num_columns)
+          resize_grid(&pplane_state, num_rows, num_columns);
+
+        /* Trajectories are shown growing a slice at a time */
+        nk_layout_row_dynamic(ctx, 25, 1);
+        nk_property_float(ctx, "Slice (ms):", 1, &pplane_state.solve_budget_ms,
+                          100, 1, 1);
+
       }
       nk_end(ctx);
 
@@ -537,54 +1788,97 @@ int main(int argc, char *argv[]) {
         nk_edit_string(ctx, NK_EDIT_SIMPLE, ybuffer, &ylen, 128, nk_filter_ascii);
         ybuffer[ylen] = 0;
 
+        /* Optional; trajectories end where it becomes positive */
+        static int stoplen = 0;
+        static char stopbuffer[128] = "";
+
+        nk_layout_row_dynamic(ctx, 25, 1);
+        nk_label(ctx, "Stop when > 0:", NK_TEXT_LEFT);
+        nk_edit_string(ctx, NK_EDIT_SIMPLE, stopbuffer, &stoplen, 128, nk_filter_ascii);
+        stopbuffer[stoplen] = 0;
+
         if (nk_button_label(ctx, "Apply")) {
-          snprintf(pplane_state.xeqn, 128, "%s", xbuffer);
-          snprintf(pplane_state.yeqn, 128, "%s", ybuffer);
+          snprintf(pplane_state.xeqn, sizeof(pplane_state.xeqn), "%s", xbuffer);
+          snprintf(pplane_state.yeqn, sizeof(pplane_state.yeqn), "%s", ybuffer);
+          snprintf(pplane_state.stop_eqn, sizeof(pplane_state.stop_eqn), "%s", stopbuffer);
+          if (compile_equations(&pplane_state))
+            invalidate_solutions(&gl_state);
+        }
+
+        if (pplane_state.eqn_error[0]) {
+          nk_layout_row_dynamic(ctx, 25, 1);
+          nk_label(ctx, pplane_state.eqn_error, NK_TEXT_LEFT);
+        }
+
+        /* Parameters are read by the compiled programs at run time, so
+           a new value only needs the solutions recomputed. */
+        param_table_t *params = &pplane_state.params;
+        for (int i = 0; i < params->count; i++) {
+          char label[MAX_PARAM_NAME + 2];
+          snprintf(label, sizeof(label), "%s:", params->names[i]);
+
+          float value = params->values[i];
+          nk_layout_row_dynamic(ctx, 25, 1);
+          nk_property_float(ctx, label, -1000, &value, 1000, 0.1, 0.01);
+          if (value != params->values[i]) {
+            params->values[i] = value;
+            pplane_state.dirty |= DIRTY_PARAMS;
+            invalidate_solutions(&gl_state);
+          }
         }
-      }
-      nk_end(ctx);
-    }
 
-    /* TODO: Check whether bounds have changed before doing this.  */
-    recompute_scale_and_translate(&pplane_state);
-    fill_plane_data(&pplane_state);
-
-    fill_axes_data(&pplane_state);
-    set_mouse_position(&pplane_state);
-
-    /* Solver test */
-    /* TODO- Add a check to re-fill solutions buffer only when
-       necessary */
-    if (gl_state.solutions.recompute_solutions) {
-      for (int c = 0; c < gl_state.solutions.num_solutions; c++) {
-        vec2 current;
-        current.x = gl_state.solutions.init[c][0];
-        current.y = gl_state.solutions.init[c][1];
-
-        float dt = -SOLUTION_DT;
-        for (int i = HALF_NUM_STEPS_PER_SOLUTION; i >= 0; i--) {
-          vec2 current_canon = real_to_canonical_coords(&pplane_state,
-                                                        current.x, current.y);
-          gl_state.solutions.solutions[c][i][0] = current_canon.x;
-          gl_state.solutions.solutions[c][i][1] = current_canon.y;
-          current = rk4(&pplane_state, current, dt);
+        nk_layout_row_dynamic(ctx, 25, 2);
+        /* Not ||, which would skip drawing the second */
+        if (nk_checkbox_label(ctx, "JIT", &pplane_state.use_jit) |
+            nk_checkbox_label(ctx, "Fast math", &pplane_state.fast_math))
+          pplane_state.dirty |= DIRTY_SYSTEM;
+
+        bool jit_available = pplane_state.compiled->jit.scalar != NULL;
+        if (pplane_state.use_jit && !jit_available) {
+          nk_layout_row_dynamic(ctx, 25, 1);
+          nk_label(ctx, "JIT unavailable, using the interpreter",
+                   NK_TEXT_LEFT);
+        }
+        if (!gl_state.plane.field_program &&
+            !pplane_state.field_shader_changed) {
+          nk_layout_row_dynamic(ctx, 25, 1);
+          nk_label(ctx, pplane_state.compiled->field_shader_ok ?
+                   "Field on CPU (shader failed)" :
+                   "Field on CPU (shader too long)", NK_TEXT_LEFT);
         }
 
-        dt = SOLUTION_DT;
-        current.x = gl_state.solutions.init[c][0];
-        current.y = gl_state.solutions.init[c][1];
+        if (gl_state.plane.arrow_program) {
+          nk_layout_row_dynamic(ctx, 25, 1);
+          /* The field program is built for one way of drawing */
+          if (nk_checkbox_label(ctx, "Instanced arrows",
+                                &pplane_state.instanced_arrows))
+            pplane_state.field_shader_changed = true;
+        }
 
-        for (int i = HALF_NUM_STEPS_PER_SOLUTION; i < 2*HALF_NUM_STEPS_PER_SOLUTION; i++) {
-          vec2 current_canon = real_to_canonical_coords(&pplane_state,
-                                                        current.x, current.y);
-          gl_state.solutions.solutions[c][i][0] = current_canon.x;
-          gl_state.solutions.solutions[c][i][1] = current_canon.y;
-          current = rk4(&pplane_state, current, dt);
+        if (jit_available) {
+          nk_layout_row_dynamic(ctx, 25, 1);
+          if (nk_button_label(ctx, "Compare"))
+            compare_evaluators(&pplane_state);
+          for (int i = 0; i < 4 && pplane_state.comparison[0][0]; i++) {
+            nk_layout_row_dynamic(ctx, 20, 1);
+            nk_label(ctx, pplane_state.comparison[i], NK_TEXT_LEFT);
+          }
         }
       }
-      gl_state.solutions.recompute_solutions = false;
+      nk_end(ctx);
     }
 
+    if (pplane_state.field_shader_changed) {
+      create_field_program(&pplane_state);
+      pplane_state.field_shader_changed = false;
+      /* The CPU takes over if the program could not be built */
+      pplane_state.dirty |= DIRTY_SYSTEM;
+    }
+
+    update_plane(&pplane_state);
+
+    update_solutions(&pplane_state);
+
     /* Draw */
     {float bg[4];
       nk_color_fv(bg, background);
@@ -600,7 +1894,21 @@ int main(int argc, char *argv[]) {
   }
 
   nk_sdl_shutdown();
+  solve_job_abandon(&pplane_state);
+  solver_thread_destroy(&pplane_state.solver);
+  thread_pool_destroy(&pplane_state.pool);
+  free(gl_state.solutions.solutions);
+  free(gl_state.solutions.uploads);
+  free(gl_state.solutions.draw_first);
+  free(gl_state.solutions.draw_count);
+  arena_destroy(&gl_state.solutions.vertices);
+  glDeleteVertexArrays(1, &gl_state.plane.field_vao);
+  compile_cache_release(pplane_state.compile_cache);
   free(gl_state.plane.points);
+  free(gl_state.plane.grid_x);
+  free(gl_state.plane.grid_y);
+  free(gl_state.plane.dir_x);
+  free(gl_state.plane.dir_y);
   SDL_GL_DeleteContext(context);
   SDL_DestroyWindow(window);
   SDL_Quit();
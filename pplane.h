@@ -1,10 +1,48 @@
 #pragma once
 
+#include "interpreter.h"
+#include "jit.h"
+#include "pool.h"
+#include "arena.h"
+
 /* TODO: These will become configurable from the UI */
 #define HALF_NUM_STEPS_PER_SOLUTION 800
 #define SOLUTION_DT 0.01f
 
-#define MAX_SOLUTIONS 20
+/* Error allowed per step of the adaptive integrators, relative to the
+   size of the solution (or absolute, below 1) */
+#define DOPRI5_TOLERANCE 1e-6f
+
+typedef enum {
+  INTEGRATOR_RK4,
+  INTEGRATOR_DOPRI5,
+  INTEGRATOR_ROSENBROCK,
+  /* Dormand-Prince, switching to Rosenbrock while the system is stiff */
+  INTEGRATOR_AUTO,
+  NUM_INTEGRATORS
+} integrator_t;
+
+/* A trajectory through `init`, in real coordinates so that changing
+   the view needs no integration; the vertex shader maps them to the
+   screen. Its backward [0] and forward [1] halves each start at the
+   initial condition, and are kept as arena blocks. */
+typedef struct {
+  float init[2];
+  /* Each half's block, the samples drawn from it and its size; count
+     is 0 when there is no block */
+  int first[2], count[2], size[2];
+  unsigned solved;
+  /* Changed when only this solution is made out of date, so results
+     for it already being computed are not taken */
+  unsigned version;
+
+  /* Whether each half left the box {min_x, min_y, max_x, max_y} it
+     was integrated with */
+  bool clipped[2];
+  float box[4];
+} solution_t;
+
+#define MAX_FIELD_SHADER 32768
 
 
 typedef struct {
@@ -23,17 +61,35 @@ struct {
     } attributes;
 
     struct {
-      GLint scale;
+      GLint scale, translate;
     } uniforms;
   } axes;
 
   struct {
-    int num_solutions;
-    bool recompute_solutions;
+    int num_solutions, capacity;
+    solution_t *solutions;
+    bool recompute_solutions;   /* some trajectory is out of date */
+
+    /* A trajectory is up to date while its `solved` matches this.
+       Anything that changes every trajectory (the system, parameters
+       or integrator) bumps the generation. */
+    unsigned generation;
+
+    /* Vertices of every solution, mirrored in `vbo`. Blocks end
+       before `extent`. */
+    vertex_arena_t vertices;
+    int extent, vbo_capacity;   /* in vertices */
 
-    /* TODO storage for solutions should get resized when necessary */
-    float solutions[MAX_SOLUTIONS][HALF_NUM_STEPS_PER_SOLUTION*2][2];
-    float init[MAX_SOLUTIONS][2];
+    /* Ranges {first, count} of vertices changed since the last upload */
+    int (*uploads)[2];
+    int num_uploads, upload_capacity;
+
+    /* Every half of every solution, for one glMultiDrawArrays();
+       rebuilt when `draws_changed` is set */
+    GLint *draw_first;
+    GLsizei *draw_count;
+    int num_draws, draw_capacity;
+    bool draws_changed;
 
     GLuint vertex_shader, fragment_shader, shader_program;
     GLuint vao, vbo;
@@ -43,7 +99,7 @@ struct {
     } attributes;
 
     struct {
-      GLint scale;
+      GLint scale, translate;
     } uniforms;
   } solutions;
 
@@ -60,13 +116,98 @@ struct {
       GLint scale;
     } uniforms;
 
+    /* Draws each point in `vbo` as an instance of a static mesh rather
+       than building its arrow in the geometry shader. Needs GL 3.3, and
+       is 0 without it. */
+    GLuint arrow_vertex_shader, arrow_program, arrow_vao, mesh_vbo;
+
+    /* Evaluates the equations in the vertex shader, so the points above
+       are only needed when this is 0 because the shader could not be
+       built. Reuses the fragment and geometry shaders, or the mesh.
+       The program belongs to the compile cache entry in use. */
+    GLuint field_program, field_vao;
+
+    struct {
+      GLint grid_size, bounds_min, bounds_max, cursor, params;
+    } field_uniforms;
+
     point_vertex *points;
+
+    /* Structure-of-arrays scratch for batched field evaluation */
+    float *grid_x, *grid_y, *dir_x, *dir_y;
   } plane;
 } gl_state_t;
 
+#define COMPILE_CACHE_SIZE 8
+
+/* Everything built from one pair of equations */
+typedef struct {
+  /* 0 for an empty entry */
+  unsigned last_used;
+
+  /* The equations, normalised by normalise_equation() */
+  uint64_t key;
+  char xeqn[128], yeqn[128], stop_eqn[128];
+
+  compiled_system_t system;
+
+  /* The parameters `system` uses, with their values from when it was
+     last in use */
+  param_table_t params;
+
+  /* Native code for the programs in `system`, used instead of the
+     interpreter when `use_jit` is set and compilation succeeded. */
+  jit_code_t jit, jacobian_jit;
+
+  /* Vertex shader for the field of `system`, if it fitted */
+  char field_shader_src[MAX_FIELD_SHADER];
+  bool field_shader_ok;
+
+  /* That shader linked for drawing arrows instanced or not, as
+     `field_instanced` says, once `field_program_built`. 0 if it could
+     not be. */
+  GLuint field_program;
+  bool field_instanced;
+  bool field_program_built;
+
+  /* In use by a solve job, so not to be evicted */
+  bool pinned;
+} compiled_entry_t;
+
+typedef struct solve_job solve_job_t;
+
+/* Runs solve jobs one at a time on the thread pool, so integration
+   never holds up the thread drawing the UI */
+typedef struct {
+  SDL_Thread *thread;
+  SDL_mutex *mutex;
+  SDL_cond *wake;
+  solve_job_t *pending;
+  bool quit;
+
+  /* Pushed to the main loop when a job has something new to show, if
+     one is not already waiting there in `woken` */
+  Uint32 event;
+  SDL_atomic_t woken;
+} solver_thread_t;
+
+/* Inputs to the axes, field and cursor arrow. Each is set in
+   `pplane_state_t.dirty` when it changes, and update_plane() reruns
+   only the stages that read it. */
+enum {
+  DIRTY_BOUNDS = 1 << 0,
+  DIRTY_SYSTEM = 1 << 1,        /* the equations, or how they are evaluated */
+  DIRTY_PARAMS = 1 << 2,
+  DIRTY_GRID = 1 << 3,
+  DIRTY_CURSOR = 1 << 4,
+  DIRTY_ALL = (1 << 5) - 1
+};
+
 typedef struct {
   gl_state_t *gl_state;
 
+  /* The field's grid of arrows, and the cursor's */
+  int num_rows, num_columns;
   int32_t num_points;
   size_t points_size;
 
@@ -74,5 +215,65 @@ typedef struct {
   float scaleX, scaleY;
   float translateX, translateY;
 
-  char xeqn[64], yeqn[64];
+  unsigned dirty;
+  /* Canonical position the cursor arrow was last placed at */
+  float cursor[2];
+
+  char xeqn[128], yeqn[128];
+  /* Trajectories end where this is positive; empty for none */
+  char stop_eqn[128];
+
+  /* Recently compiled equations; `compiled` is the entry for the
+     current ones. */
+  compiled_entry_t *compile_cache;
+  compiled_entry_t *compiled;
+  unsigned compile_clock;
+
+  /* Values of the current system's parameters */
+  param_table_t params;
+
+  int use_jit;
+  integrator_t integrator;
+
+  /* Integrates trajectories in parallel, driven by `solver` */
+  thread_pool_t pool;
+  solver_thread_t solver;
+  /* The job the solver is working on, or NULL */
+  solve_job_t *job;
+  /* How long the solver integrates between showing its progress */
+  float solve_budget_ms;
+
+  /* Polynomial kernels instead of libm for batched evaluation */
+  int fast_math;
+
+  /* Draw arrows with the arrow program, when there is one, rather than
+     the geometry shader, which is slow in software GL */
+  int instanced_arrows;
+
+  /* Set when `compiled` changes, until its field shader is built */
+  bool field_shader_changed;
+
+  /* Message for the last equations that failed to compile */
+  char eqn_error[64];
+
+  /* Lines of the result of the last comparison of the interpreter with
+     the JIT, for the current system; empty if there has not been one */
+  char comparison[4][40];
 } pplane_state_t;
+
+/* What a thread needs to evaluate the system. Contexts are cheap to
+   make and each thread uses its own; the program they point to must
+   not be recompiled while they are in use. */
+typedef struct {
+  const program_t *program;
+  const program_t *jacobian;
+  const program_t *stop;
+  const float *params;
+
+  /* NULL to use the interpreter */
+  jit_scalar_fn jit_scalar;
+  jit_packed_fn jit_packed;
+  jit_scalar_fn jacobian_jit_scalar;
+
+  bool fast_math;
+} eval_context_t;
@@ -1,4 +1,5 @@
 #define GLSL(src) "#version 150 core\n" #src
+#define GLSL_PART(src) #src
 
 const char* vertex_shader_src =
   GLSL(
@@ -22,6 +23,67 @@ const char* vertex_shader_src =
        }
        );
 
+/* Evaluates the field on the GPU: point `i` is grid point (i /
+   columns, i % columns), and the point after the grid is the cursor.
+   glsl_field_shader() puts the `params` uniform and the generated
+   `field` function between these two halves, and one of the `main`s
+   below is linked after them. */
+const char* field_vertex_shader_head =
+  GLSL(
+       uniform ivec2 grid_size;
+       uniform vec2 bounds_min;
+       uniform vec2 bounds_max;
+       uniform vec2 cursor;
+
+       float c_pow(float a, float b) {
+         if (a >= 0.0 || b != floor(b))
+           return pow(a, b);
+         float r = pow(-a, b);
+         return mod(b, 2.0) == 1.0 ? -r : r;
+       }
+       );
+
+const char* field_vertex_shader_tail =
+  GLSL_PART(
+            void field_point(int i, out vec2 canonical, out vec2 dir) {
+              canonical = cursor;
+              float arrow_length = 1.0;
+              if (i < grid_size.x * grid_size.y) {
+                ivec2 index = ivec2(i / grid_size.y, i % grid_size.y);
+                canonical = -1.0 + 2.0 * vec2(index) / vec2(grid_size);
+                arrow_length = 0.05;
+              }
+
+              vec2 p = bounds_min + (canonical + 1.0) * 0.5 * (bounds_max - bounds_min);
+              dir = arrow_length * normalize(field(p.x, p.y));
+            }
+            );
+
+/* One point per vertex, for the geometry shader */
+const char* field_points_main =
+  GLSL_PART(
+            out vec2 vDir;
+
+            void main() {
+              vec2 canonical;
+              field_point(gl_VertexID, canonical, vDir);
+              gl_Position = vec4(canonical, 0.0, 1.0);
+            }
+            );
+
+/* One arrow mesh per instance; link with arrow_mesh_shader_src */
+const char* field_instanced_main =
+  GLSL_PART(
+            vec4 arrow_vertex(vec2 pos, vec2 dir);
+
+            void main() {
+              vec2 canonical;
+              vec2 dir;
+              field_point(gl_InstanceID, canonical, dir);
+              gl_Position = arrow_vertex(canonical, dir);
+            }
+            );
+
 const char* fragment_shader_src =
   GLSL(
        out vec4 outColor;
@@ -69,11 +131,45 @@ const char* geometry_shader_src =
        );
 
 
+/* The instanced replacement for the geometry shader: draws
+   `arrow_mesh` once per point, with `pos` and `dir` advancing per
+   instance. Link with arrow_mesh_shader_src. */
+const char* arrow_vertex_shader_src =
+  GLSL(
+       in vec2 pos;
+       in vec2 dir;
+
+       vec4 arrow_vertex(vec2 pos, vec2 dir);
+
+       void main() {
+         gl_Position = arrow_vertex(pos, dir);
+       }
+       );
+
+/* Places vertex `arrow` of the mesh for an arrow from `pos` to pos +
+   dir: arrow.x is the fraction of `dir` along the shaft, and arrow.yz
+   the offset of the arrowhead's barbs, along and across `dir`, so the
+   barbs keep their length whatever the arrow's. */
+const char* arrow_mesh_shader_src =
+  GLSL_PART(
+            in vec3 arrow;
+
+            vec4 arrow_vertex(vec2 pos, vec2 dir) {
+              float magnitude = length(dir);
+              vec2 along = magnitude > 0.0 ? dir / magnitude : vec2(1.0, 0.0);
+              vec2 across = vec2(-along.y, along.x);
+              vec2 barb = 0.04 * (arrow.y * along + arrow.z * across);
+              return vec4(pos + arrow.x * dir + barb, 0.0, 1.0);
+            }
+            );
+
+/* Maps `pos` to the screen as pos * scale_factor - translate */
 const char* axes_vertex_shader_src =
   GLSL(
        in vec2 pos;
 
        uniform vec2 scale_factor;
+       uniform vec2 translate;
 
        mat4 scale(float x, float y) {
          return mat4(x, 0.0, 0.0, 0.0,
@@ -83,7 +179,8 @@ const char* axes_vertex_shader_src =
        }
 
        void main() {
-         gl_Position = scale(scale_factor.x, scale_factor.y) * vec4(pos, 0.0, 1.0);
+         gl_Position = scale(scale_factor.x, scale_factor.y) * vec4(pos, 0.0, 1.0)
+           - vec4(translate, 0.0, 0.0);
        }
        );
 
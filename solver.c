@@ -1,7 +1,12 @@
 #include "vec2.c"
 #include "pplane.h"
 
-vec2 diffeq_system(pplane_state_t *pplane_state, vec2 current);
+vec2 diffeq_system(const eval_context_t *ctx, vec2 current);
+vec2 diffeq_jacobian(const eval_context_t *ctx, vec2 current,
+                     float jacobian[2][2]);
+void diffeq_system_batch(const eval_context_t *ctx, int n,
+                         const float *xs, const float *ys, float **derivs);
+bool diffeq_stops(const eval_context_t *ctx, vec2 current);
 
 vec2
 rk4_weighted_avg(vec2 a, vec2 b, vec2 c, vec2 d) {
@@ -15,13 +20,13 @@ rk4_weighted_avg(vec2 a, vec2 b, vec2 c, vec2 d) {
 
 /* Compute next step of autonomous differential equation. */
 vec2
-rk4(pplane_state_t *pplane_state, vec2 current, float dt) {
-  vec2 k1 = diffeq_system(pplane_state, current);
-  vec2 k2 = diffeq_system(pplane_state,
+rk4(const eval_context_t *ctx, vec2 current, float dt) {
+  vec2 k1 = diffeq_system(ctx, current);
+  vec2 k2 = diffeq_system(ctx,
                           vec2_add(current, vec2_scale(dt/2, k1)));
-  vec2 k3 = diffeq_system(pplane_state,
+  vec2 k3 = diffeq_system(ctx,
                           vec2_add(current, vec2_scale(dt/2, k2)));
-  vec2 k4 = diffeq_system(pplane_state,
+  vec2 k4 = diffeq_system(ctx,
                           vec2_add(current, vec2_scale(dt, k3)));
 
   vec2 k = rk4_weighted_avg(k1, k2, k3, k4);
@@ -30,3 +35,448 @@ rk4(pplane_state_t *pplane_state, vec2 current, float dt) {
 
   return result;
 }
+
+/* State of the adaptive integrators. It is advanced one accepted step
+   at a time, and the solution is available anywhere inside the last
+   step through dense output, so samples at fixed times cost no extra
+   evaluations. */
+typedef struct {
+  float t, h;                   /* h is signed, and is the next step */
+  float dt;                     /* interval between samples */
+  vec2 y, k1;                   /* k1 is f(y) */
+
+  /* Last accepted step, [t_prev, t], for dense output */
+  float t_prev, h_prev;
+  vec2 rcont[5];
+
+  /* Jacobian at y, kept up to date only by rosenbrock_step() and
+     detect_stiffness() */
+  float jacobian[2][2];
+
+  /* Whether the automatic integrator is taking Rosenbrock steps, and
+     how many steps in a row have suggested it should switch */
+  bool stiff;
+  int switch_votes;
+} adaptive_t;
+
+void
+adaptive_init(adaptive_t *s, const eval_context_t *ctx, vec2 init,
+              float h, bool with_jacobian) {
+  s->t = s->t_prev = 0;
+  s->h = s->dt = h;
+  s->h_prev = 0;
+  s->y = init;
+  if (with_jacobian)
+    s->k1 = diffeq_jacobian(ctx, init, s->jacobian);
+  else
+    s->k1 = diffeq_system(ctx, init);
+  for (int i = 0; i < 5; i++)
+    s->rcont[i] = init;
+  s->stiff = false;
+  s->switch_votes = 0;
+}
+
+/* The shortest step worth trying: shorter ones are lost to the
+   rounding of t, or near t = 0 are a vanishing part of a sample */
+static float
+adaptive_min_step(const adaptive_t *s) {
+  return 4 * FLT_EPSILON * fmaxf(fabsf(s->t), fabsf(s->dt));
+}
+
+/* RMS of the error of a step from y0 to y1, with mixed absolute and
+   relative scaling, relative to `tolerance` */
+static float
+adaptive_error(vec2 y0, vec2 y1, vec2 err, float tolerance) {
+  float scale_x = 1 + fmaxf(fabsf(y0.x), fabsf(y1.x));
+  float scale_y = 1 + fmaxf(fabsf(y0.y), fabsf(y1.y));
+  float ex = err.x / (tolerance * scale_x);
+  float ey = err.y / (tolerance * scale_y);
+  return sqrtf(0.5f * (ex*ex + ey*ey));
+}
+
+/* Accept a step of `h` to y1, where f(y1) = k_end. The first four
+   dense output coefficients interpolate y and f at both ends; the
+   caller sets rcont[4]. */
+static void
+adaptive_accept(adaptive_t *s, float h, vec2 y1, vec2 k_end) {
+  vec2 diff = { y1.x - s->y.x, y1.y - s->y.y };
+  vec2 bspl = { h*s->k1.x - diff.x, h*s->k1.y - diff.y };
+  s->rcont[0] = s->y;
+  s->rcont[1] = diff;
+  s->rcont[2] = bspl;
+  s->rcont[3] = (vec2){ diff.x - h*k_end.x - bspl.x,
+                        diff.y - h*k_end.y - bspl.y };
+  s->rcont[4] = (vec2){ 0, 0 };
+
+  s->t_prev = s->t;
+  s->h_prev = h;
+  s->t += h;
+  s->y = y1;
+  s->k1 = k_end;
+}
+
+/* a + t0*k0 + t1*k1 + ... for up to six stages */
+static vec2
+dopri5_combine(vec2 a, float h, const vec2 *k, const float *b, int n) {
+  vec2 sum = {0, 0};
+  for (int i = 0; i < n; i++)
+    sum = vec2_add(sum, vec2_scale(b[i], k[i]));
+  return vec2_add(a, vec2_scale(h, sum));
+}
+
+/* Take one Dormand-Prince 5(4) step, retrying with smaller ones until
+   the error is within `tolerance`. Returns false if that cannot be
+   done, e.g. because the solution has blown up. */
+bool
+dopri5_step(adaptive_t *s, const eval_context_t *ctx, float tolerance) {
+  static const float a2[] = { 1.0/5 };
+  static const float a3[] = { 3.0/40, 9.0/40 };
+  static const float a4[] = { 44.0/45, -56.0/15, 32.0/9 };
+  static const float a5[] = { 19372.0/6561, -25360.0/2187, 64448.0/6561,
+                              -212.0/729 };
+  static const float a6[] = { 9017.0/3168, -355.0/33, 46732.0/5247,
+                              49.0/176, -5103.0/18656 };
+  static const float b[] = { 35.0/384, 0, 500.0/1113, 125.0/192,
+                             -2187.0/6784, 11.0/84 };
+  /* Difference between the 5th and embedded 4th order solutions */
+  static const float e[] = { 71.0/57600, 0, -71.0/16695, 71.0/1920,
+                             -17253.0/339200, 22.0/525, -1.0/40 };
+  /* Dense output, from Hairer's DOPRI5 */
+  static const float d[] = { -12715105075.0/11282082432, 0,
+                             87487479700.0/32700410799,
+                             -10690763975.0/1880347072,
+                             701980252875.0/199316789632,
+                             -1453857185.0/822651844,
+                             69997945.0/29380423 };
+
+  for (int attempt = 0; attempt < 64; attempt++) {
+    float h = s->h;
+    vec2 k[7];
+    k[0] = s->k1;
+    k[1] = diffeq_system(ctx, dopri5_combine(s->y, h, k, a2, 1));
+    k[2] = diffeq_system(ctx, dopri5_combine(s->y, h, k, a3, 2));
+    k[3] = diffeq_system(ctx, dopri5_combine(s->y, h, k, a4, 3));
+    k[4] = diffeq_system(ctx, dopri5_combine(s->y, h, k, a5, 4));
+    k[5] = diffeq_system(ctx, dopri5_combine(s->y, h, k, a6, 5));
+    vec2 y1 = dopri5_combine(s->y, h, k, b, 6);
+    k[6] = diffeq_system(ctx, y1);
+
+    vec2 err = dopri5_combine((vec2){0, 0}, h, k, e, 7);
+    float error = adaptive_error(s->y, y1, err, tolerance);
+
+    float factor = 0.9f * powf(fmaxf(error, 1e-10f), -0.2f);
+    factor = fminf(fmaxf(factor, 0.2f), 10.0f);
+    if (!(error <= 1)) {
+      if (fabsf(h) < adaptive_min_step(s))
+        return false;
+      s->h = isfinite(error) ? h * fminf(factor, 1) : h / 10;
+      continue;
+    }
+
+    adaptive_accept(s, h, y1, k[6]);
+    s->rcont[4] = dopri5_combine((vec2){0, 0}, h, k, d, 7);
+    s->h = h * factor;
+    return true;
+  }
+  return false;
+}
+
+/* Solve (I - c J) x = b */
+static bool
+solve_shifted(float jacobian[2][2], float c, vec2 b, vec2 *x) {
+  float m00 = 1 - c*jacobian[0][0], m01 = -c*jacobian[0][1];
+  float m10 = -c*jacobian[1][0], m11 = 1 - c*jacobian[1][1];
+  float det = m00*m11 - m01*m10;
+  if (det == 0 || !isfinite(det))
+    return false;
+  x->x = (m11*b.x - m01*b.y) / det;
+  x->y = (m00*b.y - m10*b.x) / det;
+  return true;
+}
+
+/* Take one step of the L-stable, linearly implicit Rosenbrock pair of
+   Shampine and Reichelt (as in MATLAB's ode23s), which stays stable at
+   steps far beyond the fastest decay rate of a stiff system. The
+   solution is second order; its error is estimated to third order
+   through (I - d h J)^-1, which damps it on the stiff components.
+   Dense output is cubic Hermite. Needs s->jacobian to be the Jacobian
+   at s->y. */
+bool
+rosenbrock_step(adaptive_t *s, const eval_context_t *ctx, float tolerance) {
+  const float d = 1 / (2 + sqrtf(2));
+  const float e32 = 6 + sqrtf(2);
+
+  for (int attempt = 0; attempt < 64; attempt++) {
+    float h = s->h;
+    vec2 k1, k2, k3, y1, f1, f2;
+    float error = INFINITY;
+    float next_jacobian[2][2];
+
+    if (solve_shifted(s->jacobian, d*h, s->k1, &k1)) {
+      f1 = diffeq_system(ctx, vec2_add(s->y, vec2_scale(h/2, k1)));
+      vec2 b2 = { f1.x - k1.x, f1.y - k1.y };
+      if (solve_shifted(s->jacobian, d*h, b2, &k2)) {
+        k2 = vec2_add(k2, k1);
+        y1 = vec2_add(s->y, vec2_scale(h, k2));
+        f2 = diffeq_jacobian(ctx, y1, next_jacobian);
+        vec2 b3 = { f2.x - e32*(k2.x - f1.x) - 2*(k1.x - s->k1.x),
+                    f2.y - e32*(k2.y - f1.y) - 2*(k1.y - s->k1.y) };
+        if (solve_shifted(s->jacobian, d*h, b3, &k3)) {
+          vec2 err = { h/6 * (k1.x - 2*k2.x + k3.x),
+                       h/6 * (k1.y - 2*k2.y + k3.y) };
+          error = adaptive_error(s->y, y1, err, tolerance);
+        }
+      }
+    }
+
+    float factor = 0.9f * powf(fmaxf(error, 1e-10f), -1.0f/3);
+    factor = fminf(fmaxf(factor, 0.2f), 5.0f);
+    if (!(error <= 1)) {
+      if (fabsf(h) < adaptive_min_step(s))
+        return false;
+      s->h = isfinite(error) ? h * fminf(factor, 1) : h / 10;
+      continue;
+    }
+
+    adaptive_accept(s, h, y1, f2);
+    memcpy(s->jacobian, next_jacobian, sizeof(next_jacobian));
+    s->h = h * factor;
+    return true;
+  }
+  return false;
+}
+
+/* Largest magnitude of the eigenvalues of the Jacobian with negative
+   real parts: the decay rate that limits explicit steps. */
+static float
+stiffness(float jacobian[2][2]) {
+  float half_trace = 0.5f * (jacobian[0][0] + jacobian[1][1]);
+  float det = jacobian[0][0]*jacobian[1][1] - jacobian[0][1]*jacobian[1][0];
+  float disc = half_trace*half_trace - det;
+
+  if (disc < 0)                 /* complex pair, |lambda|^2 = det */
+    return half_trace < 0 ? sqrtf(det) : 0;
+
+  float root = sqrtf(disc);
+  float lambda1 = half_trace - root, lambda2 = half_trace + root;
+  return fmaxf(fmaxf(-lambda1, -lambda2), 0);
+}
+
+/* Decide after each step of the automatic integrator whether the next
+   should be Rosenbrock or Dormand-Prince. Dormand-Prince is stable for
+   h*rate up to about 3.3, so steps pinned near that are limited by
+   stability rather than accuracy. A few steps in a row must agree
+   before switching either way. */
+static void
+detect_stiffness(adaptive_t *s, const eval_context_t *ctx) {
+  if (!s->stiff)
+    diffeq_jacobian(ctx, s->y, s->jacobian);
+
+  float h_rate = fabsf(s->h_prev) * stiffness(s->jacobian);
+  bool vote = s->stiff ? h_rate < 2.0f : h_rate > 3.0f;
+  s->switch_votes = vote ? s->switch_votes + 1 : 0;
+  if (s->switch_votes >= 10) {
+    s->stiff = !s->stiff;
+    s->switch_votes = 0;
+  }
+}
+
+/* The solution at `t`, which must lie within the last step */
+vec2
+adaptive_dense(const adaptive_t *s, float t) {
+  if (s->h_prev == 0)
+    return s->y;
+
+  float theta = (t - s->t_prev) / s->h_prev;
+  float theta1 = 1 - theta;
+  const vec2 *r = s->rcont;
+  vec2 result;
+  result.x = r[0].x + theta*(r[1].x + theta1*(r[2].x + theta*(r[3].x + theta1*r[4].x)));
+  result.y = r[0].y + theta*(r[1].y + theta1*(r[2].y + theta*(r[3].y + theta1*r[4].y)));
+  return result;
+}
+
+/* When a trajectory is ended early */
+typedef struct {
+  float min_x, min_y, max_x, max_y;   /* has left this box */
+  float min_speed;                    /* has all but stopped */
+} stop_criteria_t;
+
+/* Whether a trajectory that has moved from `prev` to `p` in time dt
+   should end at `p`. Non-finite points are handled by the callers,
+   since they end the trajectory before the point. */
+static bool
+should_stop(const eval_context_t *ctx, const stop_criteria_t *stop,
+            vec2 prev, vec2 p, float dt) {
+  if (p.x < stop->min_x || p.x > stop->max_x ||
+      p.y < stop->min_y || p.y > stop->max_y)
+    return true;
+
+  float dx = p.x - prev.x, dy = p.y - prev.y;
+  float min_step = stop->min_speed * dt;
+  if (dx*dx + dy*dy < min_step*min_step)
+    return true;
+
+  return diffeq_stops(ctx, p);
+}
+
+/* A trajectory integrated a slice at a time. samples[0] is the
+   initial condition and samples[i] the solution at time i*dt; the
+   first `length` have been written, none until integration starts. */
+typedef struct {
+  vec2 *samples;
+  int length;
+  bool done;                    /* stopped early */
+  adaptive_t adaptive;          /* state of the adaptive integrators */
+} trajectory_t;
+
+void
+trajectory_init(trajectory_t *trajectory, vec2 init, vec2 *samples) {
+  trajectory->samples = samples;
+  trajectory->samples[0] = init;
+  trajectory->length = 0;
+  trajectory->done = false;
+}
+
+/* Carry `trajectory` on until it has `until` samples, stopping early
+   if it meets `stop` or cannot be continued. A negative dt integrates
+   backwards. Slices of any size give the same samples. */
+void
+integrate(const eval_context_t *ctx, integrator_t integrator,
+          trajectory_t *trajectory, float dt, int until,
+          const stop_criteria_t *stop) {
+  adaptive_t *s = &trajectory->adaptive;
+  vec2 *samples = trajectory->samples;
+  if (trajectory->length == 0) {
+    if (integrator != INTEGRATOR_RK4) {
+      adaptive_init(s, ctx, samples[0], dt, integrator != INTEGRATOR_DOPRI5);
+      s->stiff = integrator == INTEGRATOR_ROSENBROCK;
+    }
+    trajectory->length = 1;
+  }
+
+  for (int i = trajectory->length; i < until && !trajectory->done; i++) {
+    float t = i * dt;
+    vec2 p;
+
+    if (integrator == INTEGRATOR_RK4) {
+      p = rk4(ctx, samples[i-1], dt);
+    }
+    else {
+      while ((t - s->t) * dt > 0) {
+        bool ok = s->stiff ? rosenbrock_step(s, ctx, DOPRI5_TOLERANCE)
+                           : dopri5_step(s, ctx, DOPRI5_TOLERANCE);
+        if (!ok) {
+          trajectory->done = true;
+          return;
+        }
+        if (integrator == INTEGRATOR_AUTO)
+          detect_stiffness(s, ctx);
+      }
+      p = adaptive_dense(s, t);
+    }
+
+    if (!isfinite(p.x) || !isfinite(p.y)) {
+      trajectory->done = true;
+      return;
+    }
+    samples[i] = p;
+    trajectory->length = i + 1;
+    if (should_stop(ctx, stop, samples[i-1], p, dt))
+      trajectory->done = true;
+  }
+}
+
+/* Carry `n` trajectories on in lockstep with RK4, as integrate()
+   would. Those still going must all have the same length. Each stage
+   is one batched evaluation over the trajectories still being
+   followed, held as structure-of-arrays; those that stop are dropped
+   from the batch. */
+void
+integrate_batch(const eval_context_t *ctx, int n, trajectory_t **trajectories,
+                float dt, int until, const stop_criteria_t *stop) {
+  if (n <= 0)
+    return;
+
+  float *scratch = malloc(sizeof(float) * 12 * n);
+  int *trajectory = malloc(sizeof(int) * n);
+  if (!scratch || !trajectory) {
+    /* Stopped where they are, as if they could not be continued */
+    for (int c = 0; c < n; c++)
+      trajectories[c]->done = true;
+    free(trajectory);
+    free(scratch);
+    return;
+  }
+  float *x = scratch, *y = x + n, *tx = y + n, *ty = tx + n;
+  float *kx[4], *ky[4];
+  for (int s = 0; s < 4; s++) {
+    kx[s] = ty + n + 2*s*n;
+    ky[s] = kx[s] + n;
+  }
+
+  int active = 0, start = until;
+  for (int c = 0; c < n; c++) {
+    trajectory_t *t = trajectories[c];
+    if (t->done)
+      continue;
+    if (t->length == 0)
+      t->length = 1;
+    if (t->length >= until)
+      continue;
+    x[active] = t->samples[t->length - 1].x;
+    y[active] = t->samples[t->length - 1].y;
+    trajectory[active++] = c;
+    start = t->length;
+  }
+
+  for (int i = start; i < until && active > 0; i++) {
+    float *k1[2] = { kx[0], ky[0] };
+    diffeq_system_batch(ctx, active, x, y, k1);
+
+    /* The later stages are evaluated at x + h*k of the one before */
+    static const float stage_h[3] = { 0.5f, 0.5f, 1.0f };
+    for (int s = 1; s < 4; s++) {
+      float h = stage_h[s-1] * dt;
+      for (int j = 0; j < active; j++) {
+        tx[j] = x[j] + h * kx[s-1][j];
+        ty[j] = y[j] + h * ky[s-1][j];
+      }
+      float *k[2] = { kx[s], ky[s] };
+      diffeq_system_batch(ctx, active, tx, ty, k);
+    }
+
+    /* Rounded as rk4() is, so single trajectories agree */
+    for (int j = 0; j < active; j++) {
+      float avg_x = (kx[0][j] + 2*kx[1][j] + 2*kx[2][j] + kx[3][j]) / 6.0;
+      float avg_y = (ky[0][j] + 2*ky[1][j] + 2*ky[2][j] + ky[3][j]) / 6.0;
+      x[j] += dt * avg_x;
+      y[j] += dt * avg_y;
+    }
+
+    /* Record the step, and drop trajectories that stop by moving the
+       last active one into their place. */
+    for (int j = 0; j < active;) {
+      trajectory_t *t = trajectories[trajectory[j]];
+      vec2 p = { x[j], y[j] };
+
+      if (isfinite(p.x) && isfinite(p.y)) {
+        t->samples[i] = p;
+        t->length = i + 1;
+        if (!should_stop(ctx, stop, t->samples[i-1], p, dt)) {
+          j++;
+          continue;
+        }
+      }
+      t->done = true;
+
+      active--;
+      x[j] = x[active];
+      y[j] = y[active];
+      trajectory[j] = trajectory[active];
+    }
+  }
+
+  free(trajectory);
+  free(scratch);
+}
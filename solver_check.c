@@ -0,0 +1,106 @@
+/* Checks of the integrators against systems whose solutions are known
+   to go on. Built and run by `make check`. */
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <float.h>
+
+#include <GL/gl3w.h>
+#include <SDL2/SDL.h>
+
+#include "pplane.h"
+#include "solver.c"
+
+/* The relaxation oscillator x' = y, y' = ((1 - x^2) y - x) / e, which
+   is stiff for small e: it creeps along slow branches and jumps
+   between them in a time of order e. */
+static float relaxation_e;
+
+vec2
+diffeq_jacobian(const eval_context_t *ctx, vec2 p, float jacobian[2][2]) {
+  float e = relaxation_e;
+  jacobian[0][0] = 0;
+  jacobian[0][1] = 1;
+  jacobian[1][0] = (-2*p.x*p.y - 1) / e;
+  jacobian[1][1] = (1 - p.x*p.x) / e;
+
+  vec2 result = { p.y, ((1 - p.x*p.x)*p.y - p.x) / e };
+  return result;
+}
+
+vec2
+diffeq_system(const eval_context_t *ctx, vec2 p) {
+  float jacobian[2][2];
+  return diffeq_jacobian(ctx, p, jacobian);
+}
+
+void
+diffeq_system_batch(const eval_context_t *ctx, int n,
+                    const float *xs, const float *ys, float **derivs) {
+  for (int i = 0; i < n; i++) {
+    vec2 result = diffeq_system(ctx, (vec2){ xs[i], ys[i] });
+    derivs[0][i] = result.x;
+    derivs[1][i] = result.y;
+  }
+}
+
+bool
+diffeq_stops(const eval_context_t *ctx, vec2 p) {
+  return false;
+}
+
+/* Integrate a solution half from (2, 0) with each adaptive integrator.
+   Each must reach the end, and agree with Dormand-Prince there. */
+static int
+check_relaxation(float e) {
+  const char *names[NUM_INTEGRATORS] = {
+    [INTEGRATOR_DOPRI5] = "Dormand-Prince",
+    [INTEGRATOR_ROSENBROCK] = "Rosenbrock",
+    [INTEGRATOR_AUTO] = "automatic",
+  };
+  const integrator_t integrators[] = {
+    INTEGRATOR_DOPRI5, INTEGRATOR_ROSENBROCK, INTEGRATOR_AUTO
+  };
+  /* The fast jumps reach |y| of order 1/e */
+  const stop_criteria_t stop = {
+    .min_x = -1e5f, .min_y = -1e5f, .max_x = 1e5f, .max_y = 1e5f,
+    .min_speed = 1e-6f,
+  };
+  const int until = HALF_NUM_STEPS_PER_SOLUTION + 1;
+  static vec2 samples[HALF_NUM_STEPS_PER_SOLUTION + 1];
+
+  relaxation_e = e;
+  int failures = 0;
+  vec2 reference = { 0, 0 };
+  for (int i = 0; i < 3; i++) {
+    trajectory_t trajectory;
+    trajectory_init(&trajectory, (vec2){ 2, 0 }, samples);
+    integrate(NULL, integrators[i], &trajectory, SOLUTION_DT, until, &stop);
+
+    vec2 end = samples[trajectory.length - 1];
+    if (i == 0)
+      reference = end;
+    bool ok = trajectory.length == until && !trajectory.done &&
+      fabsf(end.x - reference.x) < 1e-2f &&
+      fabsf(end.y - reference.y) < 1e-2f;
+    if (!ok) {
+      printf("FAIL %s, e = %g: %d of %d samples, ending at (%g, %g)\n",
+             names[integrators[i]], e, trajectory.length, until,
+             end.x, end.y);
+      failures++;
+    }
+  }
+  return failures;
+}
+
+int main(int argc, char *argv[]) {
+  int failures = check_relaxation(1) + check_relaxation(0.001f);
+  if (failures == 0)
+    printf("solver checks passed\n");
+  return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}